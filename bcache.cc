@@ -0,0 +1,659 @@
+#include "bcache.h"
+#include "slock.h"
+#include "method_thread.h"
+#include <stdio.h>
+#include <string.h>
+#include <algorithm>
+
+buffer_cache::buffer_cache(disk *d, uint32_t nbuf)
+  : d(d), mem((size_t)nbuf * BLOCK_SIZE), nbuf(nbuf), nspill(0)
+{
+  uint32_t n = std::max(1u, std::min((uint32_t)NSHARD, nbuf / SHARD_MIN));
+  uint32_t next = 0;
+
+  memset(&st, 0, sizeof(st));
+  VERIFY(pthread_mutex_init(&dm, 0) == 0);
+  VERIFY(pthread_mutex_init(&qm, 0) == 0);
+  VERIFY(pthread_cond_init(&work, 0) == 0);
+  shards.resize(n);
+  for (uint32_t k = 0; k < n; ++k) {
+    bshard &s = shards[k];
+
+    VERIFY(pthread_mutex_init(&s.m, 0) == 0);
+    VERIFY(pthread_cond_init(&s.fetched, 0) == 0);
+    s.bufs.resize(nbuf / n + (k < nbuf % n));
+    s.hand = 0;
+    memset(&s.st, 0, sizeof(s.st));
+    for (size_t i = 0; i < s.bufs.size(); ++i) {
+      s.bufs[i].id = 0;
+      s.bufs[i].valid = false;
+      s.bufs[i].dirty = false;
+      s.bufs[i].ordered = false;
+      s.bufs[i].ref = false;
+      s.bufs[i].pins = 0;
+      s.bufs[i].data = &mem[(size_t)next++ * BLOCK_SIZE];
+    }
+  }
+  if (nbuf > 0)
+    method_thread(this, true, &buffer_cache::prefetcher);
+}
+
+// The buffer of shard s holding block id, or NULL.
+buf *
+buffer_cache::lookup(bshard &s, blockid_t id)
+{
+  std::unordered_map<blockid_t, uint32_t>::iterator it = s.index.find(id);
+
+  if (it == s.index.end())
+    return NULL;
+  s.bufs[it->second].ref = true;
+  return &s.bufs[it->second];
+}
+
+// Take a buffer of shard s for block id, which must not be cached,
+// and return it with its data undefined. The clock hand passes over
+// pinned buffers and clears the reference bit of used ones; the first
+// buffer found unused since the last pass is evicted, written back
+// first if it is dirty. Ordered buffers are passed over like pinned
+// ones. Writing a victim back releases s.m, so returns NULL if block
+// id was cached in the meantime, as well as if all buffers are pinned
+// or ordered; the caller sees to it if the block was kept aside.
+buf *
+buffer_cache::install(bshard &s, blockid_t id)
+{
+  uint32_t n = s.bufs.size();
+
+  for (uint32_t k = 0; k < 2 * n; ++k) {
+    buf *b = &s.bufs[s.hand];
+    uint32_t slot = s.hand;
+
+    s.hand = (s.hand + 1) % n;
+    if (b->pins > 0 || b->ordered)
+      continue;
+    if (b->valid && b->ref) {
+      b->ref = false;
+      continue;
+    }
+    if (b->valid && b->dirty) {
+      clean(s, b);
+      if (s.index.count(id))
+        return NULL;
+      // used or written again while s.m was released
+      if (b->pins > 0 || b->ordered || b->ref || b->dirty)
+        continue;
+    }
+    if (b->valid) {
+      s.index.erase(b->id);
+      ++s.st.evictions;
+    }
+    b->id = id;
+    b->valid = true;
+    b->dirty = false;
+    b->ref = true;
+    s.index[id] = slot;
+    return b;
+  }
+  return NULL;
+}
+
+// Move the copy of b's block kept aside, if any, into b, which holds
+// it from then on as an ordered block. Returns whether there was one.
+bool
+buffer_cache::unspill(bshard &s, buf *b)
+{
+  std::unordered_map<blockid_t, std::vector<char> >::iterator it;
+
+  if ((it = s.spill.find(b->id)) == s.spill.end())
+    return false;
+  memcpy(b->data, &it->second[0], BLOCK_SIZE);
+  b->dirty = true;
+  b->ordered = true;
+  s.spill.erase(it);
+  __atomic_sub_fetch(&nspill, 1, __ATOMIC_RELAXED);
+  return true;
+}
+
+// The buffer of block id if it is cached in shard s, dirty and free
+// to be written back by clean(), or NULL.
+buf *
+buffer_cache::dirty_buf(bshard &s, blockid_t id)
+{
+  std::unordered_map<blockid_t, uint32_t>::iterator it;
+
+  if (&shard(id) != &s || (it = s.index.find(id)) == s.index.end())
+    return NULL;
+  buf *b = &s.bufs[it->second];
+  if (!b->dirty || b->ordered || b->pins > 0)
+    return NULL;
+  return b;
+}
+
+// Write dirty buffer b of shard s back with those of the blocks on
+// either side of it that are dirty too, up to WB_CLUSTER blocks in one
+// run. Their data is copied aside and s.m released for the write, b
+// pinned so it stays put; dm is taken first, so that a later
+// writeback of any of the blocks cannot reach the disk ahead of this
+// one.
+void
+buffer_cache::clean(bshard &s, buf *b)
+{
+  blockid_t lo = b->id, hi = b->id;
+  std::vector<char> tmp;
+
+  while (hi - lo + 1 < WB_CLUSTER && dirty_buf(s, hi + 1) != NULL)
+    ++hi;
+  while (hi - lo + 1 < WB_CLUSTER && lo > 0 && dirty_buf(s, lo - 1) != NULL)
+    --lo;
+  tmp.resize((size_t)(hi - lo + 1) * BLOCK_SIZE);
+  for (blockid_t id = lo; id <= hi; ++id) {
+    buf *x = id == b->id ? b : dirty_buf(s, id);
+    memcpy(&tmp[(size_t)(id - lo) * BLOCK_SIZE], x->data, BLOCK_SIZE);
+    x->dirty = false;
+  }
+  s.st.writebacks += hi - lo + 1;
+
+  disk_io io = { lo, hi - lo + 1, &tmp[0], true };
+  std::vector<disk_io> ios(1, io);
+  ++b->pins;
+  VERIFY(pthread_mutex_lock(&dm) == 0);
+  VERIFY(pthread_mutex_unlock(&s.m) == 0);
+  d->submit(ios);
+  VERIFY(pthread_mutex_unlock(&dm) == 0);
+  VERIFY(pthread_mutex_lock(&s.m) == 0);
+  --b->pins;
+}
+
+// Return block id pinned in its buffer, reading it on a miss, or NULL
+// if every buffer is pinned. Whoever changes data must set dirty, and
+// release the buffer when done with it. A miss is read aside with the
+// shard lock released, pending like a prefetched block, and cached
+// only if nothing wrote or freed the block meanwhile.
+buf *
+buffer_cache::get(blockid_t id)
+{
+  bshard &s = shard(id);
+  ScopedLock l(&s.m);
+  char tmp[BLOCK_SIZE];
+  buf *b;
+
+  while (1) {
+    while (s.pending.count(id))
+      VERIFY(pthread_cond_wait(&s.fetched, &s.m) == 0);
+    if ((b = lookup(s, id)) != NULL) {
+      ++s.st.hits;
+      break;
+    }
+    if (s.spill.count(id)) {
+      if ((b = install(s, id)) != NULL) {
+        unspill(s, b);
+        break;
+      }
+      if (!s.index.count(id))
+        return NULL;
+      continue;
+    }
+
+    s.pending.insert(id);
+    VERIFY(pthread_mutex_unlock(&s.m) == 0);
+    {
+      ScopedLock dl(&dm);
+      d->read_block(id, tmp);
+    }
+    VERIFY(pthread_mutex_lock(&s.m) == 0);
+    bool fresh = s.pending.erase(id) > 0;
+    VERIFY(pthread_cond_broadcast(&s.fetched) == 0);
+    if (!fresh || lookup(s, id) != NULL || s.spill.count(id))
+      continue;
+    if ((b = install(s, id)) != NULL) {
+      ++s.st.misses;
+      if (!unspill(s, b))
+        memcpy(b->data, tmp, BLOCK_SIZE);
+      break;
+    }
+    // cached by another thread while install() wrote back a victim
+    if (!s.index.count(id))
+      return NULL;
+  }
+  ++b->pins;
+  return b;
+}
+
+void
+buffer_cache::release(buf *b)
+{
+  bshard &s = shard(b->id);
+  ScopedLock l(&s.m);
+
+  if (b->pins > 0)
+    --b->pins;
+}
+
+// Read every block of ios, hits from their buffers and misses from the
+// disk in one batch, caching what was read. A block being read ahead
+// is waited for rather than read twice. The misses are read without
+// holding a shard lock, pending like prefetched blocks, so other
+// threads' hits go on meanwhile. The shards are gone through in order,
+// so that a thread waiting for a pending block holds pending blocks of
+// earlier shards only, and no two wait for each other.
+void
+buffer_cache::read(std::vector<block_io> &ios)
+{
+  std::vector<std::vector<size_t> > by(shards.size());
+  std::unordered_map<blockid_t, std::vector<char> >::iterator it;
+  std::vector<block_io> miss;
+  std::vector<char> tmp;
+  buf *b;
+
+  if (nbuf == 0 && spilled() == 0) {
+    transfer(ios, false);
+    return;
+  }
+
+  for (size_t i = 0; i < ios.size(); ++i)
+    by[&shard(ios[i].id) - &shards[0]].push_back(i);
+  for (size_t k = 0; k < shards.size(); ++k) {
+    bshard &s = shards[k];
+    size_t first = miss.size();
+
+    if (by[k].empty())
+      continue;
+    ScopedLock l(&s.m);
+    for (size_t j = 0; j < by[k].size(); ++j) {
+      block_io &io = ios[by[k][j]];
+
+      while (s.pending.count(io.id))
+        VERIFY(pthread_cond_wait(&s.fetched, &s.m) == 0);
+      if ((b = lookup(s, io.id)) != NULL) {
+        ++s.st.hits;
+        memcpy(io.buf, b->data, io.len);
+      } else if ((it = s.spill.find(io.id)) != s.spill.end()) {
+        ++s.st.hits;
+        memcpy(io.buf, &it->second[0], io.len);
+      } else {
+        ++s.st.misses;
+        miss.push_back(io);
+      }
+    }
+    for (size_t i = first; i < miss.size(); ++i)
+      s.pending.insert(miss[i].id);
+  }
+  if (miss.empty())
+    return;
+
+  // read whole blocks aside so they can be cached as well
+  tmp.resize(miss.size() * BLOCK_SIZE);
+  std::vector<block_io> whole(miss);
+  for (size_t i = 0; i < whole.size(); ++i) {
+    whole[i].buf = &tmp[i * BLOCK_SIZE];
+    whole[i].len = BLOCK_SIZE;
+  }
+  transfer(whole, false);
+
+  // as in prefetcher(), a block taken off pending meanwhile is stale
+  for (size_t i = 0; i < miss.size(); ) {
+    bshard &s = shard(miss[i].id);
+    ScopedLock l(&s.m);
+
+    for (; i < miss.size() && &shard(miss[i].id) == &s; ++i) {
+      memcpy(miss[i].buf, whole[i].buf, miss[i].len);
+      if (s.pending.erase(miss[i].id) && lookup(s, miss[i].id) == NULL &&
+          (b = install(s, miss[i].id)) != NULL && !unspill(s, b))
+        memcpy(b->data, whole[i].buf, BLOCK_SIZE);
+    }
+    VERIFY(pthread_cond_broadcast(&s.fetched) == 0);
+  }
+}
+
+// Copy every block of ios into its buffer and mark it dirty; the disk
+// sees it on eviction or flush. With ordered, it sees it only once
+// flush() names it. A block no buffer can be had for is written
+// through, unless it is ordered: that one is kept aside until flushed,
+// and spilled() tells the caller to flush soon.
+void
+buffer_cache::write(std::vector<block_io> &ios, bool ordered)
+{
+  std::vector<block_io> through;
+  buf *b;
+
+  for (size_t i = 0; i < ios.size(); ) {
+    bshard &s = shard(ios[i].id);
+    ScopedLock l(&s.m);
+
+    for (; i < ios.size() && &shard(ios[i].id) == &s; ++i) {
+      blockid_t id = ios[i].id;
+
+      // a block being read ahead is now newer in the cache than on disk
+      s.pending.erase(id);
+      if ((b = lookup(s, id)) != NULL) {
+        ++s.st.hits;
+      } else if ((b = install(s, id)) != NULL) {
+        ++s.st.misses;
+      } else if ((b = lookup(s, id)) == NULL) {
+        if (!ordered && !s.spill.count(id)) {
+          through.push_back(ios[i]);
+          continue;
+        }
+        if (!s.spill.count(id))
+          __atomic_add_fetch(&nspill, 1, __ATOMIC_RELAXED);
+        std::vector<char> &v = s.spill[id];
+        v.assign(BLOCK_SIZE, 0);
+        memcpy(&v[0], ios[i].buf, ios[i].len);
+        continue;
+      }
+      unspill(s, b);
+      memcpy(b->data, ios[i].buf, ios[i].len);
+      memset(b->data + ios[i].len, 0, BLOCK_SIZE - ios[i].len);
+      b->dirty = true;
+      b->ordered = b->ordered || ordered;
+    }
+    // under the lock, so that no read of the shard caches an older copy
+    if (!through.empty())
+      transfer(through, true);
+    through.clear();
+  }
+}
+
+// Drop block id from the cache without writing it back: it has been
+// freed, so its contents no longer matter.
+void
+buffer_cache::forget(blockid_t id)
+{
+  bshard &s = shard(id);
+  ScopedLock l(&s.m);
+  std::unordered_map<blockid_t, uint32_t>::iterator it = s.index.find(id);
+
+  s.pending.erase(id);
+  if (s.spill.erase(id))
+    __atomic_sub_fetch(&nspill, 1, __ATOMIC_RELAXED);
+  if (it == s.index.end() || s.bufs[it->second].pins > 0)
+    return;
+  s.bufs[it->second].valid = false;
+  s.bufs[it->second].dirty = false;
+  s.bufs[it->second].ordered = false;
+  s.index.erase(it);
+}
+
+// Write every dirty buffer but the ordered ones back, a batch for
+// each shard.
+void
+buffer_cache::flush()
+{
+  for (size_t k = 0; k < shards.size(); ++k) {
+    ScopedLock l(&shards[k].m);
+
+    writeback(shards[k]);
+  }
+}
+
+// Write back those of ids that are cached and dirty, ordered or not,
+// or kept aside, leaving the rest of the cache as it is.
+void
+buffer_cache::flush(const std::vector<blockid_t> &ids)
+{
+  std::vector<std::vector<blockid_t> > by(shards.size());
+  std::unordered_map<blockid_t, uint32_t>::iterator it;
+
+  for (size_t i = 0; i < ids.size(); ++i)
+    by[&shard(ids[i]) - &shards[0]].push_back(ids[i]);
+  for (size_t k = 0; k < shards.size(); ++k) {
+    bshard &s = shards[k];
+    std::unordered_map<blockid_t, std::vector<char> > aside;
+    std::vector<block_io> ios;
+
+    if (by[k].empty())
+      continue;
+    ScopedLock l(&s.m);
+    for (size_t i = 0; i < by[k].size(); ++i) {
+      blockid_t id = by[k][i];
+
+      if (s.spill.count(id)) {
+        std::vector<char> &v = aside[id];
+        v.swap(s.spill[id]);
+        s.spill.erase(id);
+        __atomic_sub_fetch(&nspill, 1, __ATOMIC_RELAXED);
+        block_io io = { id, &v[0], BLOCK_SIZE };
+        ios.push_back(io);
+        continue;
+      }
+      if ((it = s.index.find(id)) == s.index.end() ||
+          !s.bufs[it->second].dirty)
+        continue;
+      buf *b = &s.bufs[it->second];
+      block_io io = { b->id, b->data, BLOCK_SIZE };
+      ios.push_back(io);
+      b->dirty = false;
+      b->ordered = false;
+    }
+    if (ios.empty())
+      continue;
+    s.st.writebacks += ios.size();
+    transfer(ios, true);
+  }
+}
+
+// Write every dirty buffer of shard s but the ordered ones back to the
+// disk in one batch. Called with s.m held.
+void
+buffer_cache::writeback(bshard &s)
+{
+  std::vector<block_io> ios;
+
+  for (size_t i = 0; i < s.bufs.size(); ++i) {
+    if (!s.bufs[i].dirty || s.bufs[i].ordered)
+      continue;
+    block_io io = { s.bufs[i].id, s.bufs[i].data, BLOCK_SIZE };
+    ios.push_back(io);
+    s.bufs[i].dirty = false;
+  }
+  if (ios.empty())
+    return;
+  s.st.writebacks += ios.size();
+  transfer(ios, true);
+}
+
+// Carry out ios on the disk directly, for blocks that are never
+// cached, in turn with the prefetch thread.
+void
+buffer_cache::submit(std::vector<disk_io> &ios)
+{
+  ScopedLock dl(&dm);
+
+  d->submit(ios);
+}
+
+// Make every write the disk has completed durable.
+void
+buffer_cache::barrier()
+{
+  ScopedLock dl(&dm);
+
+  d->flush();
+}
+
+bool
+buffer_cache::cached(blockid_t id)
+{
+  bshard &s = shard(id);
+  ScopedLock l(&s.m);
+
+  return s.index.count(id) || s.pending.count(id) || s.spill.count(id);
+}
+
+// Ordered blocks kept aside for want of a buffer.
+size_t
+buffer_cache::spilled()
+{
+  return __atomic_load_n(&nspill, __ATOMIC_RELAXED);
+}
+
+// The counts of all shards added up.
+const bcache_stats &
+buffer_cache::stats()
+{
+  memset(&st, 0, sizeof(st));
+  for (size_t k = 0; k < shards.size(); ++k) {
+    ScopedLock l(&shards[k].m);
+
+    st.hits += shards[k].st.hits;
+    st.misses += shards[k].st.misses;
+    st.evictions += shards[k].st.evictions;
+    st.writebacks += shards[k].st.writebacks;
+    st.prefetched += shards[k].st.prefetched;
+  }
+  return st;
+}
+
+// Queue the blocks of ids that are neither cached nor on their way
+// for the prefetch thread, up to PREFETCH_MAX waiting at once.
+void
+buffer_cache::prefetch(const std::vector<blockid_t> &ids)
+{
+  std::vector<blockid_t> take;
+  size_t room;
+
+  if (nbuf == 0)
+    return;
+  {
+    ScopedLock q(&qm);
+    room = PREFETCH_MAX - std::min(queue.size(), (size_t)PREFETCH_MAX);
+  }
+  for (size_t i = 0; i < ids.size() && take.size() < room; ) {
+    bshard &s = shard(ids[i]);
+    ScopedLock l(&s.m);
+
+    for (; i < ids.size() && take.size() < room && &shard(ids[i]) == &s; ++i) {
+      if (ids[i] == 0 || s.index.count(ids[i]) || s.pending.count(ids[i]) ||
+          s.spill.count(ids[i]))
+        continue;
+      s.pending.insert(ids[i]);
+      take.push_back(ids[i]);
+    }
+  }
+  if (take.empty())
+    return;
+  ScopedLock q(&qm);
+  queue.insert(queue.end(), take.begin(), take.end());
+  VERIFY(pthread_cond_signal(&work) == 0);
+}
+
+// Prefetch thread: read whatever is queued as one batch, without
+// holding any lock, then cache each block that is still pending; a
+// write or free in the meantime takes a block off pending, making
+// what was read stale.
+void
+buffer_cache::prefetcher()
+{
+  std::vector<block_io> ios;
+  std::vector<char> tmp;
+  buf *b;
+
+  while (1) {
+    {
+      ScopedLock q(&qm);
+      while (queue.empty())
+        VERIFY(pthread_cond_wait(&work, &qm) == 0);
+      tmp.resize(queue.size() * BLOCK_SIZE);
+      ios.clear();
+      for (size_t i = 0; i < queue.size(); ++i) {
+        block_io io = { queue[i], &tmp[i * BLOCK_SIZE], BLOCK_SIZE };
+        ios.push_back(io);
+      }
+      queue.clear();
+    }
+
+    transfer(ios, false);
+
+    for (size_t i = 0; i < ios.size(); ) {
+      bshard &s = shard(ios[i].id);
+      ScopedLock l(&s.m);
+
+      for (; i < ios.size() && &shard(ios[i].id) == &s; ++i) {
+        if (s.pending.erase(ios[i].id) == 0 || s.index.count(ios[i].id) ||
+            (b = install(s, ios[i].id)) == NULL || unspill(s, b))
+          continue;
+        memcpy(b->data, ios[i].buf, BLOCK_SIZE);
+        b->ref = false;
+        ++s.st.prefetched;
+      }
+      VERIFY(pthread_cond_broadcast(&s.fetched) == 0);
+    }
+  }
+}
+
+static bool
+block_io_before(const block_io &a, const block_io &b)
+{
+  return a.id < b.id;
+}
+
+// Sort ios by block and hand the disk one batch with a run for each
+// stretch of blocks that is contiguous on disk. Blocks that are not
+// also contiguous in memory, or are short, are gathered through a
+// bounce area so the run stays whole.
+void
+buffer_cache::transfer(std::vector<block_io> &ios, bool write)
+{
+  std::vector<block_io> sorted(ios);
+  std::vector<disk_io> runs;
+  std::vector<char> bounce;
+  std::vector<size_t> first;   // index in sorted of each run's first block
+
+  std::sort(sorted.begin(), sorted.end(), block_io_before);
+  for (size_t i = 0; i < sorted.size(); ++i) {
+    if (!runs.empty() && runs.back().id + runs.back().n == sorted[i].id) {
+      ++runs.back().n;
+      continue;
+    }
+    disk_io io = { sorted[i].id, 1, NULL, write };
+    runs.push_back(io);
+    first.push_back(i);
+  }
+
+  // a run whose blocks already sit back to back, whole, in memory is
+  // transferred in place; the others go through the bounce area
+  size_t nbounce = 0;
+  std::vector<bool> direct(runs.size());
+  for (size_t r = 0; r < runs.size(); ++r) {
+    direct[r] = true;
+    for (size_t k = 0; k < runs[r].n; ++k) {
+      block_io &io = sorted[first[r] + k];
+      if (io.len < BLOCK_SIZE ||
+          io.buf != sorted[first[r]].buf + k * BLOCK_SIZE)
+        direct[r] = false;
+    }
+    if (!direct[r])
+      nbounce += runs[r].n;
+  }
+  bounce.assign(nbounce * BLOCK_SIZE, 0);
+
+  nbounce = 0;
+  for (size_t r = 0; r < runs.size(); ++r) {
+    if (direct[r]) {
+      runs[r].buf = sorted[first[r]].buf;
+      continue;
+    }
+    runs[r].buf = &bounce[nbounce * BLOCK_SIZE];
+    nbounce += runs[r].n;
+    if (!write)
+      continue;
+    for (size_t k = 0; k < runs[r].n; ++k) {
+      block_io &io = sorted[first[r] + k];
+      memcpy(runs[r].buf + k * BLOCK_SIZE, io.buf, io.len);
+    }
+  }
+  {
+    ScopedLock dl(&dm);
+    d->submit(runs);
+  }
+
+  if (write)
+    return;
+  for (size_t r = 0; r < runs.size(); ++r) {
+    if (direct[r])
+      continue;
+    for (size_t k = 0; k < runs[r].n; ++k) {
+      block_io &io = sorted[first[r] + k];
+      memcpy(io.buf, runs[r].buf + k * BLOCK_SIZE, io.len);
+    }
+  }
+}
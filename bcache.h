@@ -0,0 +1,128 @@
+// buffer cache interface.
+
+#ifndef bcache_h
+#define bcache_h
+
+#include <stdint.h>
+#include <pthread.h>
+#include <vector>
+#include <deque>
+#include <unordered_map>
+#include <unordered_set>
+#include "disk.h"
+
+// One block of a vectored transfer: len (<= BLOCK_SIZE) bytes at buf.
+// A short block is zero-padded on write and truncated on read.
+struct block_io {
+  blockid_t id;
+  char *buf;
+  uint32_t len;
+};
+
+// A cached block. pins counts the holders that may use data directly;
+// a pinned buffer is never evicted, nor is an ordered one, which is
+// written back only when flushed by id.
+struct buf {
+  blockid_t id;
+  bool valid;     // data holds block id
+  bool dirty;     // data is newer than the disk
+  bool ordered;   // dirty, and not to reach the disk before it is asked for
+  bool ref;       // used since the clock hand last passed
+  int pins;
+  char *data;
+};
+
+struct bcache_stats {
+  uint64_t hits;
+  uint64_t misses;
+  uint64_t evictions;
+  uint64_t writebacks;   // dirty blocks written to the disk
+  uint64_t prefetched;   // blocks read ahead into the cache
+};
+
+// Most blocks waiting to be read ahead at once
+#define PREFETCH_MAX 1024
+
+// Most blocks written back in one run with an evicted dirty one
+#define WB_CLUSTER 16
+
+// The cache is split into up to NSHARD shards of at least SHARD_MIN
+// buffers. Blocks go to shards SHARD_SPAN at a time, so that a run a
+// shard writes back or reads is still contiguous on disk.
+#define NSHARD     16
+#define SHARD_MIN  32
+#define SHARD_SPAN 64
+
+// One shard of the cache: the buffers, index and clock hand for the
+// blocks that map to it, with the blocks of them being read in and
+// those kept aside. m guards all of it.
+struct bshard {
+  pthread_mutex_t m;
+  std::vector<buf> bufs;
+  std::unordered_map<blockid_t, uint32_t> index;   // block -> bufs slot
+  std::unordered_map<blockid_t, std::vector<char> > spill;  // ordered, unbuffered
+  std::unordered_set<blockid_t> pending;  // queued or being read
+  pthread_cond_t fetched;                 // pending lost some blocks
+  uint32_t hand;
+  bcache_stats st;
+};
+
+// Fixed-size write-back cache of disk blocks, evicting with the CLOCK
+// algorithm. Missed blocks are read, and dirty blocks written back,
+// in batches of contiguous runs. Blocks asked for with prefetch() are
+// read in by a background thread while the caller goes on. With no
+// buffers every transfer goes straight to the disk, but for ordered
+// writes: an ordered block no buffer can be had for is kept aside in
+// memory until flushed by id.
+//
+// Each shard has a lock of its own, so that threads using blocks of
+// different shards do not wait for one another; none holds two shard
+// locks at once. Reads from the disk and writebacks on eviction are
+// made with the shard lock released; flush() and blocks written
+// through keep it. dm serializes use of the disk and is taken last.
+class buffer_cache {
+ private:
+  disk *d;
+  std::vector<bshard> shards;
+  std::vector<char> mem;
+  uint32_t nbuf;
+  size_t nspill;      // blocks kept aside, in all shards
+  bcache_stats st;
+
+  pthread_mutex_t dm;
+  pthread_mutex_t qm;                     // guards queue
+  std::deque<blockid_t> queue;            // waiting to be prefetched
+  pthread_cond_t work;                    // queue went non-empty
+
+  bshard &shard(blockid_t id) {
+    return shards[id / SHARD_SPAN % shards.size()];
+  }
+  buf *lookup(bshard &s, blockid_t id);
+  buf *install(bshard &s, blockid_t id);
+  bool unspill(bshard &s, buf *b);
+  buf *dirty_buf(bshard &s, blockid_t id);
+  void clean(bshard &s, buf *b);
+  void writeback(bshard &s);
+  void transfer(std::vector<block_io> &ios, bool write);
+  void prefetcher();
+
+ public:
+  buffer_cache(disk *d, uint32_t nbuf);
+
+  buf *get(blockid_t id);
+  void release(buf *b);
+  void read(std::vector<block_io> &ios);
+  void write(std::vector<block_io> &ios, bool ordered = false);
+  void forget(blockid_t id);
+  void flush();
+  void flush(const std::vector<blockid_t> &ids);
+  void submit(std::vector<disk_io> &ios);
+  void barrier();
+  bool cached(blockid_t id);
+  size_t spilled();
+  void prefetch(const std::vector<blockid_t> &ids);
+  uint32_t size() { return nbuf; }
+  const bcache_stats &stats();
+};
+
+#endif
@@ -0,0 +1,441 @@
+// <linux/io_uring.h> pulls in <linux/fs.h>, whose BLOCK_SIZE is not ours
+#include <linux/io_uring.h>
+#undef BLOCK_SIZE
+#include "disk.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+// O_DIRECT wants buffers aligned to the device's logical block size;
+// a page is enough for every device we care about.
+#define DIRECT_ALIGN 4096
+
+// Open (creating if necessary) the disk image at path. A new (empty)
+// image is sized to *n blocks; an existing image keeps its own size,
+// which is returned in *n.
+static int
+open_image(const char *path, int flags, uint32_t *n, bool *existed)
+{
+  struct stat st;
+  int fd;
+
+  if ((fd = open(path, O_RDWR | O_CREAT | flags, 0644)) < 0) {
+    perror("disk: open");
+    exit(1);
+  }
+  if (fstat(fd, &st) < 0) {
+    perror("disk: fstat");
+    exit(1);
+  }
+
+  *existed = st.st_size > 0;
+  if (*existed && st.st_size / BLOCK_SIZE > UINT32_MAX) {
+    printf("\tdisk: error! image %s is over %u blocks\n", path, UINT32_MAX);
+    exit(1);
+  }
+  if (*existed) {
+    *n = st.st_size / BLOCK_SIZE;
+  } else if (ftruncate(fd, (off_t)*n * BLOCK_SIZE) < 0) {
+    perror("disk: ftruncate");
+    exit(1);
+  }
+  printf("\tdisk: %s image %s, %u blocks\n",
+         *existed ? "opened" : "created", path, *n);
+  return fd;
+}
+
+void
+disk::read_block(blockid_t id, char *buf)
+{
+  if (!buf) return;
+  std::vector<disk_io> ios(1);
+  ios[0].id = id;
+  ios[0].n = 1;
+  ios[0].buf = buf;
+  ios[0].write = false;
+  submit(ios);
+}
+
+void
+disk::write_block(blockid_t id, const char *buf)
+{
+  if (!buf) return;
+  std::vector<disk_io> ios(1);
+  ios[0].id = id;
+  ios[0].n = 1;
+  ios[0].buf = (char *)buf;
+  ios[0].write = true;
+  submit(ios);
+}
+
+// mem_disk -------------------------------------------
+
+// An in-memory disk. Anonymous mappings are zero-filled on first
+// touch, so there is nothing to bzero.
+mem_disk::mem_disk()
+{
+  nblocks = BLOCK_NUM;
+  blocks = (unsigned char (*)[BLOCK_SIZE])mmap(NULL,
+      (size_t)nblocks * BLOCK_SIZE, PROT_READ | PROT_WRITE,
+      MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (blocks == MAP_FAILED) {
+    perror("disk: mmap");
+    exit(1);
+  }
+}
+
+mem_disk::mem_disk(const char *path, uint32_t n)
+{
+  int fd = open_image(path, 0, &n, &existed);
+  nblocks = n;
+  blocks = (unsigned char (*)[BLOCK_SIZE])mmap(NULL,
+      (size_t)nblocks * BLOCK_SIZE, PROT_READ | PROT_WRITE,
+      MAP_SHARED, fd, 0);
+  if (blocks == MAP_FAILED) {
+    perror("disk: mmap");
+    exit(1);
+  }
+  // the mapping holds its own reference to the file
+  close(fd);
+}
+
+mem_disk::~mem_disk()
+{
+  flush();
+  munmap(blocks, (size_t)nblocks * BLOCK_SIZE);
+}
+
+void
+mem_disk::read_block(blockid_t id, char *buf)
+{
+  if (!buf) return;
+  memcpy(buf, blocks[id], BLOCK_SIZE);
+}
+
+void
+mem_disk::write_block(blockid_t id, const char *buf)
+{
+  if (!buf) return;
+  memcpy(blocks[id], buf, BLOCK_SIZE);
+}
+
+void
+mem_disk::submit(std::vector<disk_io> &ios)
+{
+  for (size_t i = 0; i < ios.size(); ++i) {
+    size_t len = (size_t)ios[i].n * BLOCK_SIZE;
+    if (ios[i].write)
+      memcpy(blocks[ios[i].id], ios[i].buf, len);
+    else
+      memcpy(ios[i].buf, blocks[ios[i].id], len);
+  }
+}
+
+// Write dirty pages of a file-backed image through to the file.
+// A no-op for anonymous memory.
+void
+mem_disk::flush()
+{
+  if (msync(blocks, (size_t)nblocks * BLOCK_SIZE, MS_SYNC) < 0)
+    perror("disk: msync");
+}
+
+// direct_disk ----------------------------------------
+
+direct_disk::direct_disk(const char *path, uint32_t n)
+{
+  bounce = NULL;
+  fd = open_image(path, 0, &n, &existed);
+  nblocks = n;
+  direct = fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_DIRECT) == 0;
+  if (!direct) {
+    // tmpfs and friends refuse O_DIRECT outright
+    printf("\tdisk: %s does not support O_DIRECT\n", path);
+  }
+}
+
+direct_disk::~direct_disk()
+{
+  flush();
+  close(fd);
+  free(bounce);
+}
+
+// Redirect the unaligned buffers among ios[first, first+n) into one
+// aligned scratch area, copying in the data to be written.
+void
+direct_disk::bounce_in(std::vector<disk_io> &ios, size_t first, size_t n)
+{
+  size_t need = 0, off = 0;
+
+  saved.assign(n, (char *)NULL);
+  if (!direct)
+    return;
+  for (size_t i = first; i < first + n; ++i) {
+    if ((uintptr_t)ios[i].buf % DIRECT_ALIGN)
+      need += (size_t)ios[i].n * BLOCK_SIZE;
+  }
+  if (need == 0)
+    return;
+
+  free(bounce);
+  if (posix_memalign((void **)&bounce, DIRECT_ALIGN, need) != 0) {
+    perror("disk: posix_memalign");
+    exit(1);
+  }
+  for (size_t i = first; i < first + n; ++i) {
+    if ((uintptr_t)ios[i].buf % DIRECT_ALIGN == 0)
+      continue;
+    saved[i - first] = ios[i].buf;
+    if (ios[i].write)
+      memcpy(bounce + off, ios[i].buf, (size_t)ios[i].n * BLOCK_SIZE);
+    ios[i].buf = bounce + off;
+    off += (size_t)ios[i].n * BLOCK_SIZE;
+  }
+}
+
+// Undo bounce_in, copying out the data that was read.
+void
+direct_disk::bounce_out(std::vector<disk_io> &ios, size_t first, size_t n)
+{
+  for (size_t i = first; i < first + n; ++i) {
+    char *orig = saved[i - first];
+    if (orig == NULL)
+      continue;
+    if (!ios[i].write)
+      memcpy(orig, ios[i].buf, (size_t)ios[i].n * BLOCK_SIZE);
+    ios[i].buf = orig;
+  }
+}
+
+// Carry out one run synchronously, finishing short transfers.
+void
+direct_disk::transfer(disk_io &io)
+{
+  size_t len = (size_t)io.n * BLOCK_SIZE, done = 0;
+  off_t off = (off_t)io.id * BLOCK_SIZE;
+
+  while (done < len) {
+    ssize_t r = io.write ?
+        pwrite(fd, io.buf + done, len - done, off + done) :
+        pread(fd, io.buf + done, len - done, off + done);
+    if (r < 0 && errno == EINTR)
+      continue;
+    if (r < 0 && errno == EINVAL && direct) {
+      // the device's sectors are larger than BLOCK_SIZE
+      printf("\tdisk: O_DIRECT transfer rejected, using buffered I/O\n");
+      fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) & ~O_DIRECT);
+      direct = false;
+      continue;
+    }
+    if (r < 0) {
+      perror(io.write ? "disk: pwrite" : "disk: pread");
+      exit(1);
+    }
+    if (r == 0) {
+      // reading past the end of a short image
+      memset(io.buf + done, 0, len - done);
+      break;
+    }
+    done += r;
+  }
+}
+
+void
+direct_disk::submit(std::vector<disk_io> &ios)
+{
+  bounce_in(ios, 0, ios.size());
+  for (size_t i = 0; i < ios.size(); ++i)
+    transfer(ios[i]);
+  bounce_out(ios, 0, ios.size());
+}
+
+void
+direct_disk::flush()
+{
+  if (fdatasync(fd) < 0)
+    perror("disk: fdatasync");
+}
+
+// uring_disk -----------------------------------------
+
+#define URING_ENTRIES 64
+
+static int
+io_uring_setup(unsigned entries, struct io_uring_params *p)
+{
+  return syscall(__NR_io_uring_setup, entries, p);
+}
+
+static int
+io_uring_enter(int fd, unsigned to_submit, unsigned min_complete,
+               unsigned flags)
+{
+  return syscall(__NR_io_uring_enter, fd, to_submit, min_complete,
+                 flags, NULL, 0);
+}
+
+uring_disk::uring_disk(const char *path, uint32_t n)
+  : direct_disk(path, n)
+{
+  sq_ring = cq_ring = MAP_FAILED;
+  if (!setup()) {
+    printf("\tdisk: io_uring unavailable, using pread/pwrite\n");
+    ring_fd = -1;
+  }
+}
+
+uring_disk::~uring_disk()
+{
+  if (ring_fd < 0)
+    return;
+  munmap(sqes, entries * sizeof(struct io_uring_sqe));
+  if (cq_ring != sq_ring)
+    munmap(cq_ring, cq_ring_sz);
+  munmap(sq_ring, sq_ring_sz);
+  close(ring_fd);
+}
+
+// Create the ring and map its submission and completion queues.
+bool
+uring_disk::setup()
+{
+  struct io_uring_params p;
+  char *sq, *cq;
+
+  memset(&p, 0, sizeof(p));
+  if ((ring_fd = io_uring_setup(URING_ENTRIES, &p)) < 0)
+    return false;
+  entries = p.sq_entries;
+
+  sq_ring_sz = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+  cq_ring_sz = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+  if (p.features & IORING_FEAT_SINGLE_MMAP) {
+    if (cq_ring_sz > sq_ring_sz)
+      sq_ring_sz = cq_ring_sz;
+    cq_ring_sz = sq_ring_sz;
+  }
+
+  sq_ring = mmap(NULL, sq_ring_sz, PROT_READ | PROT_WRITE,
+                 MAP_SHARED | MAP_POPULATE, ring_fd, IORING_OFF_SQ_RING);
+  if (sq_ring == MAP_FAILED)
+    goto fail;
+  if (p.features & IORING_FEAT_SINGLE_MMAP)
+    cq_ring = sq_ring;
+  else
+    cq_ring = mmap(NULL, cq_ring_sz, PROT_READ | PROT_WRITE,
+                   MAP_SHARED | MAP_POPULATE, ring_fd, IORING_OFF_CQ_RING);
+  if (cq_ring == MAP_FAILED)
+    goto fail;
+  sqes = (struct io_uring_sqe *)mmap(NULL,
+      p.sq_entries * sizeof(struct io_uring_sqe), PROT_READ | PROT_WRITE,
+      MAP_SHARED | MAP_POPULATE, ring_fd, IORING_OFF_SQES);
+  if (sqes == MAP_FAILED)
+    goto fail;
+
+  sq = (char *)sq_ring;
+  sq_head = (unsigned *)(sq + p.sq_off.head);
+  sq_tail = (unsigned *)(sq + p.sq_off.tail);
+  sq_mask = (unsigned *)(sq + p.sq_off.ring_mask);
+  sq_array = (unsigned *)(sq + p.sq_off.array);
+  cq = (char *)cq_ring;
+  cq_head = (unsigned *)(cq + p.cq_off.head);
+  cq_tail = (unsigned *)(cq + p.cq_off.tail);
+  cq_mask = (unsigned *)(cq + p.cq_off.ring_mask);
+  cqes = (struct io_uring_cqe *)(cq + p.cq_off.cqes);
+  return true;
+
+fail:
+  if (cq_ring != MAP_FAILED && cq_ring != sq_ring)
+    munmap(cq_ring, cq_ring_sz);
+  if (sq_ring != MAP_FAILED)
+    munmap(sq_ring, sq_ring_sz);
+  close(ring_fd);
+  return false;
+}
+
+// Queue ios[first, first+n) (n <= entries), hand them to the kernel
+// and wait for all of them to complete. The kernel may take fewer than
+// it is offered (EAGAIN, EBUSY, a short count); the rest stay queued
+// in the ring and are offered again, after waiting for some of those
+// in flight if it took none.
+void
+uring_disk::submit_chunk(std::vector<disk_io> &ios, size_t first, size_t n)
+{
+  unsigned tail = *sq_tail, head;
+  size_t submitted = 0, done = 0;
+  bool stalled = false;
+
+  for (size_t i = first; i < first + n; ++i, ++tail) {
+    unsigned idx = tail & *sq_mask;
+    struct io_uring_sqe *sqe = &sqes[idx];
+
+    memset(sqe, 0, sizeof(*sqe));
+    sqe->opcode = ios[i].write ? IORING_OP_WRITE : IORING_OP_READ;
+    sqe->fd = fd;
+    sqe->addr = (uintptr_t)ios[i].buf;
+    sqe->len = ios[i].n * BLOCK_SIZE;
+    sqe->off = (uint64_t)ios[i].id * BLOCK_SIZE;
+    sqe->user_data = i;
+    sq_array[idx] = idx;
+  }
+  __atomic_store_n(sq_tail, tail, __ATOMIC_RELEASE);
+
+  while (done < n) {
+    // the kernel waits for completions only once it has taken all it
+    // was offered
+    bool waited = stalled;
+    int r = stalled ?
+        io_uring_enter(ring_fd, 0, 1, IORING_ENTER_GETEVENTS) :
+        io_uring_enter(ring_fd, n - submitted, n - done,
+                       IORING_ENTER_GETEVENTS);
+    stalled = false;
+    if (r < 0 && errno == EINTR)
+      continue;
+    if (r < 0 && errno != EAGAIN && errno != EBUSY) {
+      perror("disk: io_uring_enter");
+      exit(1);
+    }
+    if (r > 0 && !waited)
+      submitted += r;
+    if (r <= 0 && !waited && submitted < n)
+      stalled = submitted > done;
+
+    head = *cq_head;
+    while (head != __atomic_load_n(cq_tail, __ATOMIC_ACQUIRE)) {
+      struct io_uring_cqe *cqe = &cqes[head & *cq_mask];
+      disk_io &io = ios[cqe->user_data];
+      // errors and short transfers are redone synchronously, which
+      // also handles the O_DIRECT fallback
+      if (cqe->res != (int)(io.n * BLOCK_SIZE))
+        transfer(io);
+      ++head;
+      ++done;
+    }
+    __atomic_store_n(cq_head, head, __ATOMIC_RELEASE);
+  }
+}
+
+void
+uring_disk::submit(std::vector<disk_io> &ios)
+{
+  if (ring_fd < 0) {
+    direct_disk::submit(ios);
+    return;
+  }
+
+  for (size_t first = 0; first < ios.size(); first += entries) {
+    size_t n = ios.size() - first;
+    if (n > entries)
+      n = entries;
+    bounce_in(ios, first, n);
+    submit_chunk(ios, first, n);
+    bounce_out(ios, first, n);
+  }
+}
@@ -0,0 +1,108 @@
+// disk layer interface.
+
+#ifndef disk_h
+#define disk_h
+
+#include <stddef.h>
+#include <stdint.h>
+#include <vector>
+
+#define DISK_SIZE  1024*1024*16
+#define BLOCK_SIZE 512
+#define BLOCK_NUM  (DISK_SIZE/BLOCK_SIZE)
+
+typedef uint32_t blockid_t;
+
+// One transfer of n physically contiguous blocks starting at id,
+// to or from n*BLOCK_SIZE bytes at buf.
+struct disk_io {
+  blockid_t id;
+  uint32_t n;
+  char *buf;
+  bool write;
+};
+
+// A block device engine. Engines must implement submit(); the
+// single-block calls default to a one-element batch.
+class disk {
+ protected:
+  uint32_t nblocks;
+  bool existed;   // backing store already held a filesystem image
+
+ public:
+  disk() : nblocks(0), existed(false) {}
+  virtual ~disk() {}
+  uint32_t size() { return nblocks; }
+  bool reused() { return existed; }
+
+  virtual void read_block(blockid_t id, char *buf);
+  virtual void write_block(blockid_t id, const char *buf);
+  // Carry out every transfer in ios; returns once all are done.
+  virtual void submit(std::vector<disk_io> &ios) = 0;
+  // Make completed writes durable.
+  virtual void flush() {}
+};
+
+// Blocks in memory: anonymous (lost on exit), or a disk-image file
+// mapped MAP_SHARED so block accesses are page-cache accesses.
+class mem_disk : public disk {
+ private:
+  unsigned char (*blocks)[BLOCK_SIZE];
+
+ public:
+  mem_disk();
+  mem_disk(const char *image, uint32_t nblocks);
+  ~mem_disk();
+  void read_block(blockid_t id, char *buf);
+  void write_block(blockid_t id, const char *buf);
+  void submit(std::vector<disk_io> &ios);
+  void flush();
+};
+
+// A disk-image file accessed with pread/pwrite, one system call per
+// contiguous run, bypassing the page cache via O_DIRECT where the
+// file system supports it.
+class direct_disk : public disk {
+ protected:
+  int fd;
+  bool direct;                // fd is open O_DIRECT
+  char *bounce;               // aligned stand-in for unaligned buffers
+  std::vector<char *> saved;  // callers' buffers while bounced
+
+  void bounce_in(std::vector<disk_io> &ios, size_t first, size_t n);
+  void bounce_out(std::vector<disk_io> &ios, size_t first, size_t n);
+  void transfer(disk_io &io);
+
+ public:
+  direct_disk(const char *image, uint32_t nblocks);
+  ~direct_disk();
+  void submit(std::vector<disk_io> &ios);
+  void flush();
+};
+
+// direct_disk with the runs of a batch submitted through an io_uring,
+// so a batch costs one io_uring_enter() instead of one call per run.
+// Falls back to direct_disk when the kernel has no io_uring.
+class uring_disk : public direct_disk {
+ private:
+  int ring_fd;
+  uint32_t entries;
+  // submission queue
+  unsigned *sq_head, *sq_tail, *sq_mask, *sq_array;
+  struct io_uring_sqe *sqes;
+  // completion queue
+  unsigned *cq_head, *cq_tail, *cq_mask;
+  struct io_uring_cqe *cqes;
+  void *sq_ring, *cq_ring;
+  size_t sq_ring_sz, cq_ring_sz;
+
+  bool setup();
+  void submit_chunk(std::vector<disk_io> &ios, size_t first, size_t n);
+
+ public:
+  uring_disk(const char *image, uint32_t nblocks);
+  ~uring_disk();
+  void submit(std::vector<disk_io> &ios);
+};
+
+#endif
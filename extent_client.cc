@@ -55,4 +55,54 @@ extent_client::remove(extent_protocol::extentid_t eid)
   return ret;
 }
 
+extent_protocol::status
+extent_client::read(extent_protocol::extentid_t eid, unsigned long long off,
+                    unsigned int len, std::string &buf)
+{
+  extent_protocol::status ret = extent_protocol::OK;
+  ret = es->read(eid, off, len, buf);
+  return ret;
+}
+
+extent_protocol::status
+extent_client::write(extent_protocol::extentid_t eid, unsigned long long off,
+                     std::string buf, int &written)
+{
+  extent_protocol::status ret = extent_protocol::OK;
+  ret = es->write(eid, off, buf, written);
+  return ret;
+}
+
+extent_protocol::status
+extent_client::truncate(extent_protocol::extentid_t eid, unsigned long long size)
+{
+  extent_protocol::status ret = extent_protocol::OK;
+  int r;
+  ret = es->truncate(eid, size, r);
+  return ret;
+}
 
+extent_protocol::status
+extent_client::snapshot(std::string name, extent_protocol::extentid_t &root)
+{
+  extent_protocol::status ret = extent_protocol::OK;
+  ret = es->snapshot(name, root);
+  return ret;
+}
+
+extent_protocol::status
+extent_client::unsnapshot(std::string name)
+{
+  extent_protocol::status ret = extent_protocol::OK;
+  int r;
+  ret = es->unsnapshot(name, r);
+  return ret;
+}
+
+extent_protocol::status
+extent_client::snapname(unsigned int s, std::string &name)
+{
+  extent_protocol::status ret = extent_protocol::OK;
+  ret = es->snapname(s, name);
+  return ret;
+}
@@ -7,6 +7,8 @@
 #include "extent_protocol.h"
 #include "extent_server.h"
 
+// Holds no state of its own beyond es, which handles calls from many
+// threads at once, so it does too.
 class extent_client {
  private:
   extent_server *es;
@@ -21,6 +23,18 @@ class extent_client {
 				                          extent_protocol::attr &a);
   extent_protocol::status put(extent_protocol::extentid_t eid, std::string buf);
   extent_protocol::status remove(extent_protocol::extentid_t eid);
+  extent_protocol::status read(extent_protocol::extentid_t eid,
+                               unsigned long long off, unsigned int len,
+                               std::string &buf);
+  extent_protocol::status write(extent_protocol::extentid_t eid,
+                                unsigned long long off, std::string buf,
+                                int &written);
+  extent_protocol::status truncate(extent_protocol::extentid_t eid,
+                                   unsigned long long size);
+  extent_protocol::status snapshot(std::string name,
+                                   extent_protocol::extentid_t &root);
+  extent_protocol::status unsnapshot(std::string name);
+  extent_protocol::status snapname(unsigned int s, std::string &name);
 };
 
 #endif 
@@ -14,7 +14,13 @@ class extent_protocol {
     put = 0x6001,
     get,
     getattr,
-    remove
+    remove,
+    read,
+    write,
+    truncate,
+    snapshot,
+    unsnapshot,
+    snapname
   };
 
   enum types {
@@ -29,6 +35,8 @@ class extent_protocol {
     unsigned int mtime;
     unsigned int ctime;
     unsigned int size;
+    unsigned int blocks;
+    unsigned int generation;
   };
 };
 
@@ -40,6 +48,8 @@ operator>>(unmarshall &u, extent_protocol::attr &a)
   u >> a.mtime;
   u >> a.ctime;
   u >> a.size;
+  u >> a.blocks;
+  u >> a.generation;
   return u;
 }
 
@@ -51,6 +61,8 @@ operator<<(marshall &m, extent_protocol::attr a)
   m << a.mtime;
   m << a.ctime;
   m << a.size;
+  m << a.blocks;
+  m << a.generation;
   return m;
 }
 
@@ -19,6 +19,8 @@ int extent_server::create(uint32_t type, extent_protocol::extentid_t &id)
   // alloc a new inode and return inum
   printf("extent_server: create inode\n");
   id = im->alloc_inode(type);
+  if (id == 0)
+    return extent_protocol::IOERR;
 
   return extent_protocol::OK;
 }
@@ -26,6 +28,8 @@ int extent_server::create(uint32_t type, extent_protocol::extentid_t &id)
 int extent_server::put(extent_protocol::extentid_t id, std::string buf, int &)
 {
   id &= 0x7fffffff;
+  if (SNAP_OF(id) != 0)
+    return extent_protocol::IOERR;
   
   const char * cbuf = buf.c_str();
   int size = buf.size();
@@ -43,7 +47,8 @@ int extent_server::get(extent_protocol::extentid_t id, std::string &buf)
   int size = 0;
   char *cbuf = NULL;
 
-  im->read_file(id, &cbuf, &size);
+  if (im->read_file(id, &cbuf, &size) == IM_EIO)
+    return extent_protocol::IOERR;
   if (size == 0)
     buf = "";
   else {
@@ -73,7 +78,122 @@ int extent_server::remove(extent_protocol::extentid_t id, int &)
   printf("extent_server: write %lld\n", id);
 
   id &= 0x7fffffff;
+  if (SNAP_OF(id) != 0)
+    return extent_protocol::IOERR;
   im->remove_file(id);
  
   return extent_protocol::OK;
 }
+
+int extent_server::read(extent_protocol::extentid_t id, unsigned long long off,
+                        unsigned int len, std::string &buf)
+{
+  printf("extent_server: read %lld off %llu len %u\n", id, off, len);
+
+  id &= 0x7fffffff;
+
+  buf = "";
+  if (off >= 0xffffffffULL)
+    return extent_protocol::OK;
+
+  // len comes from the client: size buf by what the file holds
+  extent_protocol::attr attr;
+  memset(&attr, 0, sizeof(attr));
+  im->getattr(id, attr);
+  if (attr.type == 0)
+    return extent_protocol::NOENT;
+  if (off >= attr.size)
+    return extent_protocol::OK;
+  if (len > attr.size - off)
+    len = attr.size - off;
+
+  buf.resize(len);
+  int n = im->read_range(id, off, len, &buf[0]);
+  if (n < 0) {
+    buf = "";
+    return n == IM_EIO ? extent_protocol::IOERR : extent_protocol::NOENT;
+  }
+  buf.resize(n);
+
+  return extent_protocol::OK;
+}
+
+int extent_server::write(extent_protocol::extentid_t id, unsigned long long off,
+                         std::string buf, int &written)
+{
+  printf("extent_server: write %lld off %llu len %zu\n", id, off, buf.size());
+
+  id &= 0x7fffffff;
+
+  written = 0;
+  if (off + buf.size() > 0xffffffffULL || SNAP_OF(id) != 0)
+    return extent_protocol::IOERR;
+
+  written = im->write_range(id, off, buf.size(), buf.data());
+  if (written < 0) {
+    written = 0;
+    return extent_protocol::NOENT;
+  }
+
+  return extent_protocol::OK;
+}
+
+int extent_server::truncate(extent_protocol::extentid_t id,
+                            unsigned long long size, int &)
+{
+  printf("extent_server: truncate %lld to %llu\n", id, size);
+
+  id &= 0x7fffffff;
+
+  if (size > 0xffffffffULL || SNAP_OF(id) != 0)
+    return extent_protocol::IOERR;
+
+  int n = im->truncate_file(id, size);
+  if (n < 0)
+    return extent_protocol::NOENT;
+  if ((unsigned long long)n != size)
+    return extent_protocol::IOERR;
+
+  return extent_protocol::OK;
+}
+
+// Snapshot the filesystem as name; root is the snapshot's root
+// directory, through which its read-only files are reached.
+int extent_server::snapshot(std::string name, extent_protocol::extentid_t &root)
+{
+  printf("extent_server: snapshot %s\n", name.c_str());
+
+  uint32_t s = im->snapshot(name.c_str());
+  if (s == 0)
+    return extent_protocol::IOERR;
+  root = SNAP_INUM(s, 1);
+
+  return extent_protocol::OK;
+}
+
+int extent_server::unsnapshot(std::string name, int &)
+{
+  printf("extent_server: unsnapshot %s\n", name.c_str());
+
+  if (!im->drop_snapshot(name.c_str()))
+    return extent_protocol::NOENT;
+
+  return extent_protocol::OK;
+}
+
+// The name of snapshot s, for listing them by trying 1 to MAXSNAP.
+int extent_server::snapname(unsigned int s, std::string &name)
+{
+  char n[SNAP_NAME];
+
+  if (!im->snapshot_name(s, n))
+    return extent_protocol::NOENT;
+  name = n;
+
+  return extent_protocol::OK;
+}
+
+void extent_server::sync()
+{
+  im->sync();
+}
@@ -8,6 +8,8 @@
 #include "extent_protocol.h"
 #include "inode_manager.h"
 
+// Handlers run on the rpcs threads at once; inode_manager locks each
+// inode for as long as a handler works on it.
 class extent_server {
  protected:
 #if 0
@@ -27,6 +29,15 @@ class extent_server {
   int get(extent_protocol::extentid_t id, std::string &);
   int getattr(extent_protocol::extentid_t id, extent_protocol::attr &);
   int remove(extent_protocol::extentid_t id, int &);
+  int read(extent_protocol::extentid_t id, unsigned long long off,
+           unsigned int len, std::string &);
+  int write(extent_protocol::extentid_t id, unsigned long long off,
+            std::string, int &);
+  int truncate(extent_protocol::extentid_t id, unsigned long long size, int &);
+  int snapshot(std::string name, extent_protocol::extentid_t &root);
+  int unsnapshot(std::string name, int &);
+  int snapname(unsigned int s, std::string &name);
+  void sync();
 };
 
 #endif 
@@ -2,10 +2,13 @@
 #include <arpa/inet.h>
 #include <stdlib.h>
 #include <stdio.h>
+#include <unistd.h>
 #include "extent_server.h"
 
 // Main loop of extent server
 
+#define SYNC_INTERVAL 5
+
 int
 main(int argc, char *argv[])
 {
@@ -30,7 +33,16 @@ main(int argc, char *argv[])
   server.reg(extent_protocol::getattr, &ls, &extent_server::getattr);
   server.reg(extent_protocol::put, &ls, &extent_server::put);
   server.reg(extent_protocol::remove, &ls, &extent_server::remove);
-
-  while(1)
-    sleep(1000);
+  server.reg(extent_protocol::read, &ls, &extent_server::read);
+  server.reg(extent_protocol::write, &ls, &extent_server::write);
+  server.reg(extent_protocol::truncate, &ls, &extent_server::truncate);
+  server.reg(extent_protocol::snapshot, &ls, &extent_server::snapshot);
+  server.reg(extent_protocol::unsnapshot, &ls, &extent_server::unsnapshot);
+  server.reg(extent_protocol::snapname, &ls, &extent_server::snapname);
+
+  // flush a file-backed disk image every SYNC_INTERVAL seconds
+  while(1) {
+    sleep(SYNC_INTERVAL);
+    ls.sync();
+  }
 }
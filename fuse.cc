@@ -15,12 +15,100 @@
 #include <fcntl.h>
 #include <unistd.h>
 #include <arpa/inet.h>
+#include <pthread.h>
+#include <deque>
 #include "lang/verify.h"
+#include "slock.h"
 #include "yfs_client.h"
 
 int myid;
 yfs_client *yfs;
 
+// How long, in seconds, the kernel may keep a file's attributes and a
+// name's lookup before asking again: YFS_ATTR_TIMEOUT and
+// YFS_ENTRY_TIMEOUT, or 1 as fuse's own default. With 0 every stat
+// and every path component comes back here, as it used to. A fuse
+// older than 2.8 cannot tell the kernel what changed behind its back,
+// so there the default is 0.
+#if FUSE_VERSION >= 28
+double attr_timeout = 1.0;
+double entry_timeout = 1.0;
+#else
+double attr_timeout = 0;
+double entry_timeout = 0;
+#endif
+
+//
+// What the kernel caches has to be dropped when a change here makes it
+// stale without the kernel having asked for it. It learns of that
+// through notifications, which fuseserver_notifier sends from a thread
+// of its own: carrying one out takes locks in the kernel that the
+// request being handled may hold, so a handler must not wait on it.
+//
+struct fuseserver_inval {
+    yfs_client::inum inum;  // the inode, or the directory holding name
+    std::string name;       // the entry to drop, or empty for the inode
+};
+std::deque<fuseserver_inval> invals;
+pthread_mutex_t invals_m = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t invals_c = PTHREAD_COND_INITIALIZER;
+struct fuse_chan *chan;
+
+// Have the kernel drop name in directory inum, or with an empty name
+// the attributes and data it has of inum. Nothing to do if it caches
+// neither.
+void
+inval(yfs_client::inum inum, const std::string &name)
+{
+#if FUSE_VERSION >= 28
+    if (chan == NULL || (attr_timeout == 0 && entry_timeout == 0))
+        return;
+    fuseserver_inval v;
+    v.inum = inum;
+    v.name = name;
+    ScopedLock l(&invals_m);
+    invals.push_back(v);
+    VERIFY(pthread_cond_signal(&invals_c) == 0);
+#endif
+}
+
+// A kernel too old for a notification says so with -ENOSYS; it then
+// has nothing cached longer than the timeouts anyway.
+#if FUSE_VERSION >= 28
+void *
+fuseserver_notifier(void *)
+{
+    while (1) {
+        fuseserver_inval v;
+        {
+            ScopedLock l(&invals_m);
+            while (invals.empty())
+                VERIFY(pthread_cond_wait(&invals_c, &invals_m) == 0);
+            v = invals.front();
+            invals.pop_front();
+        }
+        if (v.name.empty())
+            fuse_lowlevel_notify_inval_inode(chan, v.inum, 0, 0);
+        else
+            fuse_lowlevel_notify_inval_entry(chan, v.inum, v.name.c_str(),
+                    v.name.size());
+    }
+    return NULL;
+}
+#endif
+
+//
+// Directory parent has changed. The kernel drops the attributes it has
+// of parent itself, but .snap shows those of the root, which it does
+// not know.
+//
+void
+dirchanged(fuse_ino_t parent)
+{
+    if (parent == 1)
+        inval(yfs_client::SNAPDIR, "");
+}
+
 int id() { 
     return myid;
 }
@@ -37,10 +125,17 @@ int id() {
 // less correct values for the access/modify/change times
 // (atime, mtime, and ctime), and correct values for file sizes.
 //
+// gen, if given, is set to the generation that goes with inum in an
+// entry reply. An inode number comes back when a new file gets the
+// inum of a removed one, and the inodes of a snapshot each time one is
+// taken in its slot; the kernel must not mistake the new inode for the
+// old one it may still have.
+//
 yfs_client::status
-getattr(yfs_client::inum inum, struct stat &st)
+getattr(yfs_client::inum inum, struct stat &st, unsigned long *gen = NULL)
 {
     yfs_client::status ret;
+    unsigned long g;
 
     bzero(&st, sizeof(st));
 
@@ -57,6 +152,8 @@ getattr(yfs_client::inum inum, struct stat &st)
         st.st_mtime = info.mtime;
         st.st_ctime = info.ctime;
         st.st_size = info.size;
+        st.st_blocks = info.blocks * (BLOCK_SIZE / 512);
+        g = info.generation;
         printf("   getattr -> %llu\n", info.size);
     } else if (yfs->isdir(inum)){
         yfs_client::dirinfo info;
@@ -68,6 +165,7 @@ getattr(yfs_client::inum inum, struct stat &st)
         st.st_atime = info.atime;
         st.st_mtime = info.mtime;
         st.st_ctime = info.ctime;
+        g = info.generation;
         printf("   getattr -> %lu %lu %lu\n", info.atime, info.mtime, info.ctime);
     } else {
         std::cout << "> get symlink attribute" << std::endl;
@@ -81,8 +179,14 @@ getattr(yfs_client::inum inum, struct stat &st)
         st.st_atime = info.atime;
         st.st_mtime = info.mtime;
         st.st_ctime = info.ctime;
+        g = info.generation;
         printf("   getattr -> symlink");
     }
+    // snapshots are read-only
+    if (yfs->isreadonly(inum) && inum != yfs_client::SNAPDIR)
+        st.st_mode &= ~0222;
+    if (gen)
+        *gen = g;
     return yfs_client::OK;
 }
 
@@ -114,7 +218,7 @@ fuseserver_getattr(fuse_req_t req, fuse_ino_t ino,
         fuse_reply_err(req, ENOENT);
         return;
     }
-    fuse_reply_attr(req, &st, 0);
+    fuse_reply_attr(req, &st, attr_timeout);
 }
 
 //
@@ -146,7 +250,7 @@ fuseserver_setattr(fuse_req_t req, fuse_ino_t ino, struct stat *attr,
             yfs->setattr(ino, attr->st_size);
         }
         getattr(ino, st);
-        fuse_reply_attr(req, &st, 0);
+        fuse_reply_attr(req, &st, attr_timeout);
 #else
     fuse_reply_err(req, ENOSYS);
 #endif
@@ -178,8 +282,10 @@ fuseserver_read(fuse_req_t req, fuse_ino_t ino, size_t size,
     int r;
     if ((r = yfs->read(ino, size, off, buf)) == yfs_client::OK) {
         fuse_reply_buf(req, buf.data(), buf.size());    
-    } else {
+    } else if (r == yfs_client::NOENT) {
         fuse_reply_err(req, ENOENT);
+    } else {
+        fuse_reply_err(req, EIO);
     }
 #else
     fuse_reply_err(req, ENOSYS);
@@ -244,9 +350,8 @@ fuseserver_createhelper(fuse_ino_t parent, const char *name,
         mode_t mode, struct fuse_entry_param *e, int type)
 {
     int ret;
-    // In yfs, timeouts are always set to 0.0, and generations are always set to 0
-    e->attr_timeout = 0.0;
-    e->entry_timeout = 0.0;
+    e->attr_timeout = attr_timeout;
+    e->entry_timeout = entry_timeout;
     e->generation = 0;
 
     yfs_client::inum inum;
@@ -256,8 +361,9 @@ fuseserver_createhelper(fuse_ino_t parent, const char *name,
 		ret = yfs->mkdir(parent,name,mode,inum);
     if (ret != yfs_client::OK)
         return ret;
+    dirchanged(parent);
     e->ino = inum;
-    ret = getattr(inum, e->attr);
+    ret = getattr(inum, e->attr, &e->generation);
     return ret;
 }
 
@@ -299,22 +405,37 @@ void fuseserver_mknod( fuse_req_t req, fuse_ino_t parent,
 // found, set e.attr (using getattr) and e.ino to the attribute and inum of
 // the file.
 //
+// A name that is not there is answered with ino 0, which the kernel
+// keeps as missing for entry_timeout: tools stat a good many files
+// that do not exist, over and over. Only a lookup that read @parent
+// and did not find @name is kept so; a failed one is an error.
+//
 void
 fuseserver_lookup(fuse_req_t req, fuse_ino_t parent, const char *name)
 {
     struct fuse_entry_param e;
-    // In yfs, timeouts are always set to 0.0, and generations are always set to 0
-    e.attr_timeout = 0.0;
-    e.entry_timeout = 0.0;
+    memset(&e, 0, sizeof(e));
+    e.attr_timeout = attr_timeout;
+    e.entry_timeout = entry_timeout;
     e.generation = 0;
     bool found = false;
+    int r;
 
-     yfs_client::inum ino;
-     yfs->lookup(parent, name, found, ino);
-
-    if (found) {
+    yfs_client::inum ino;
+    if ((r = yfs->lookup(parent, name, found, ino)) == yfs_client::OK &&
+        found) {
         e.ino = ino;
-        getattr(ino, e.attr);
+        r = getattr(ino, e.attr, &e.generation);
+    }
+
+    if (r == yfs_client::NOENT) {
+        fuse_reply_err(req, ENOENT);
+    } else if (r != yfs_client::OK) {
+        fuse_reply_err(req, EIO);
+    } else if (found) {
+        fuse_reply_entry(req, &e);
+    } else if (entry_timeout > 0) {
+        e.ino = 0;
         fuse_reply_entry(req, &e);
     } else {
         fuse_reply_err(req, ENOENT);
@@ -376,7 +497,10 @@ fuseserver_readdir(fuse_req_t req, fuse_ino_t ino, size_t size,
     memset(&b, 0, sizeof(b));
 
     std::list<yfs_client::dirent> entries;
-    yfs->readdir(inum, entries);
+    if (yfs->readdir(inum, entries) != yfs_client::OK) {
+        fuse_reply_err(req, EIO);
+        return;
+    }
     for (std::list<yfs_client::dirent>::iterator it = entries.begin(); it != entries.end(); ++it) {
         dirbuf_add(&b, it->name.c_str(), (fuse_ino_t) it->inum);
     }
@@ -408,9 +532,8 @@ fuseserver_mkdir(fuse_req_t req, fuse_ino_t parent, const char *name,
         mode_t mode)
 {
     struct fuse_entry_param e;
-    // In yfs, timeouts are always set to 0.0, and generations are always set to 0
-    e.attr_timeout = 0.0;
-    e.entry_timeout = 0.0;
+    e.attr_timeout = attr_timeout;
+    e.entry_timeout = entry_timeout;
     e.generation = 0;
     // Suppress compiler warning of unused e.
     (void) e;
@@ -446,6 +569,7 @@ fuseserver_unlink(fuse_req_t req, fuse_ino_t parent, const char *name)
     int r;
     if ((r = yfs->unlink(parent, name)) == yfs_client::OK) {
         fuse_reply_err(req, 0);
+        dirchanged(parent);
     } else {
         if (r == yfs_client::NOENT) {
             fuse_reply_err(req, ENOENT);
@@ -455,6 +579,39 @@ fuseserver_unlink(fuse_req_t req, fuse_ino_t parent, const char *name)
     }
 }
 
+//
+// Remove directory @name from @parent. Only snapshots, the
+// directories in .snap, can be removed.
+//
+// The next snapshot taken in the same slot gets the same inode
+// numbers, so what the kernel has of this one's root and the names in
+// it is dropped; the kernel drops @name itself.
+//
+void
+fuseserver_rmdir(fuse_req_t req, fuse_ino_t parent, const char *name)
+{
+    bool found = false;
+    yfs_client::inum root = 0;
+    std::list<yfs_client::dirent> entries;
+
+    if (parent != yfs_client::SNAPDIR) {
+        fuse_reply_err(req, ENOSYS);
+        return;
+    }
+    yfs->lookup(parent, name, found, root);
+    if (found)
+        yfs->readdir(root, entries);
+    if (yfs->unlink(parent, name) == yfs_client::OK) {
+        fuse_reply_err(req, 0);
+        for (std::list<yfs_client::dirent>::iterator it = entries.begin();
+                it != entries.end(); ++it)
+            inval(root, it->name);
+        inval(root, "");
+    } else {
+        fuse_reply_err(req, ENOENT);
+    }
+}
+
 void
 fuseserver_statfs(fuse_req_t req)
 {
@@ -470,12 +627,27 @@ fuseserver_statfs(fuse_req_t req)
     fuse_reply_statfs(req, &buf);
 }
 
+//
+// Create symbolic link @name in @parent pointing to @link, and reply
+// with its entry as for create.
+//
 void
 fuseserver_symlink(fuse_req_t req, const char *link, fuse_ino_t parent, const char *name)
 {
+    struct fuse_entry_param e;
+    bool found = false;
+    yfs_client::inum ino;
     int r;
-    if ((r = yfs->symlink(parent, name, link)) == yfs_client::OK) {
-        fuse_reply_err(req, 0);
+
+    memset(&e, 0, sizeof(e));
+    e.attr_timeout = attr_timeout;
+    e.entry_timeout = entry_timeout;
+    if ((r = yfs->symlink(parent, name, link)) == yfs_client::OK &&
+            yfs->lookup(parent, name, found, ino) == yfs_client::OK && found &&
+            getattr(ino, e.attr, &e.generation) == yfs_client::OK) {
+        dirchanged(parent);
+        e.ino = ino;
+        fuse_reply_entry(req, &e);
     } else {
         fuse_reply_err(req, EIO);
     }
@@ -492,6 +664,8 @@ fuseserver_readlink(fuse_req_t req, fuse_ino_t ino)
     } else {
         if (r == yfs_client::NOENT) {
             fuse_reply_err(req, ENOENT);
+        } else if (r == yfs_client::IOERR) {
+            fuse_reply_err(req, EIO);
         } else {
             fuse_reply_err(req, ENOLINK);
         }
@@ -501,6 +675,35 @@ fuseserver_readlink(fuse_req_t req, fuse_ino_t ino)
 
 struct fuse_lowlevel_ops fuseserver_oper;
 
+//
+// One of YFS_FUSE_THREADS threads taking requests off the channel and
+// handling them, as fuse_session_loop does on its own. The first to
+// see the channel end (unmount) ends the session for the rest.
+//
+void *
+fuseserver_worker(void *arg)
+{
+    struct fuse_session *se = (struct fuse_session *)arg;
+    struct fuse_chan *ch = fuse_session_next_chan(se, NULL);
+    size_t bufsize = fuse_chan_bufsize(ch);
+    char *buf = (char *)malloc(bufsize);
+    int res;
+
+    VERIFY(buf != NULL);
+    while (!fuse_session_exited(se)) {
+        res = fuse_chan_receive(ch, buf, bufsize);
+        if (res == -EINTR)
+            continue;
+        if (res <= 0) {
+            fuse_session_exit(se);
+            break;
+        }
+        fuse_session_process(se, buf, res, ch);
+    }
+    free(buf);
+    return NULL;
+}
+
 int
 main(int argc, char *argv[])
 {
@@ -548,6 +751,7 @@ main(int argc, char *argv[])
      * */
     fuseserver_oper.symlink    = fuseserver_symlink;
     fuseserver_oper.readlink   = fuseserver_readlink;
+    fuseserver_oper.rmdir      = fuseserver_rmdir;
 
     const char *fuse_argv[20];
     int fuse_argc = 0;
@@ -599,8 +803,34 @@ main(int argc, char *argv[])
     }
 
     fuse_session_add_chan(se, ch);
-    // err = fuse_session_loop_mt(se);   // FK: wheelfs does this; why?
-    err = fuse_session_loop(se);
+
+    const char *timeout;
+    if ((timeout = getenv("YFS_ATTR_TIMEOUT")) != NULL)
+        attr_timeout = atof(timeout);
+    if ((timeout = getenv("YFS_ENTRY_TIMEOUT")) != NULL)
+        entry_timeout = atof(timeout);
+    chan = ch;
+#if FUSE_VERSION >= 28
+    pthread_t notifier;
+    VERIFY(pthread_create(&notifier, NULL, fuseserver_notifier, NULL) == 0);
+#endif
+
+    // With YFS_FUSE_THREADS=n, n threads handle requests at once, so a
+    // slow read does not hold up every getattr behind it. fuse's own
+    // fuse_session_loop_mt does the same but picks the count itself.
+    const char *threads = getenv("YFS_FUSE_THREADS");
+    int nthreads = threads ? atoi(threads) : 1;
+    if (nthreads > 1) {
+        pthread_t *th = new pthread_t[nthreads];
+        for (int i = 0; i < nthreads; ++i)
+            VERIFY(pthread_create(&th[i], NULL, fuseserver_worker, se) == 0);
+        for (int i = 0; i < nthreads; ++i)
+            VERIFY(pthread_join(th[i], NULL) == 0);
+        delete[] th;
+        err = 0;
+    } else {
+        err = fuse_session_loop(se);
+    }
 
     fuse_session_destroy(se);
     close(fd);
@@ -4,93 +4,528 @@
 #define inode_h
 
 #include <stdint.h>
+#include <pthread.h>
+#include <unordered_map>
+#include <unordered_set>
+#include "lang/verify.h"
 #include "extent_protocol.h" // TODO: delete it
+#include "disk.h"
+#include "bcache.h"
+#include "journal.h"
 
-#define DISK_SIZE  1024*1024*16
-#define BLOCK_SIZE 512
-#define BLOCK_NUM  (DISK_SIZE/BLOCK_SIZE)
-
-typedef uint32_t blockid_t;
-
-// disk layer -----------------------------------------
-
-class disk {
- private:
-  unsigned char blocks[BLOCK_NUM][BLOCK_SIZE];
+// block layer -----------------------------------------
 
- public:
-  disk();
-  void read_block(uint32_t id, char *buf);
-  void write_block(uint32_t id, const char *buf);
-};
+#define FS_MAGIC 0x79667364 // "yfsd"
 
-// block layer -----------------------------------------
+// Superblock flags, fixed when the disk is formatted
+#define FS_EXTENTS 0x1   // inodes map data with extent trees
 
 typedef struct superblock {
+  uint32_t magic;
   uint32_t size;
   uint32_t nblocks;
   uint32_t ninodes;
+  uint32_t flags;
+  struct journal_sb journal;
 } superblock_t;
 
+// Default bytes of buffer cache, unless YFS_CACHE_SIZE says otherwise
+#define BCACHE_SIZE (4*1024*1024)
+
+// References dedup lets a block have, leaving room in its share count
+// for snapshots to multiply them
+#define DEDUP_MAX 4096
+
+// Inline dedup counts. The dedup ratio of the data written is
+// lookups / (lookups - hits).
+struct dedup_stats {
+  uint64_t lookups;      // whole data blocks checked before a write
+  uint64_t hits;         // found on disk already and not written
+  uint64_t collisions;   // fingerprint matched, contents did not
+};
+
+// Checksum counts
+struct csum_stats {
+  uint64_t verified;   // blocks read whose checksum was checked
+  uint64_t failed;     // of those, found not to match
+};
+
+// Bitmap words per bitmap block
+#define WPB           (BLOCK_SIZE/sizeof(uint64_t))
+
+// Any number of threads call in at once. am guards the allocator,
+// the share counts, the checksums and the fingerprint index, and the
+// running transaction's bookkeeping; reads of blocks take no lock.
 class block_manager {
  private:
   disk *d;
-  std::map <uint32_t, int> using_blocks;
+  buffer_cache *bc;
+  journal *j;
+  bool mounted;   // sb was read back from an existing image
+  pthread_mutex_t am;
+
+  // In-memory copy of the free block bitmap kept in the BBLOCK
+  // region, one bit per block. full has a bit per bitmap word, set
+  // when the word has no free block left, so a search skips 64
+  // words at a time.
+  std::vector<uint64_t> bitmap;
+  std::vector<uint64_t> full;
+  uint32_t cursor;    // bitmap word the next search starts at
+  uint32_t nfree;
+  uint32_t data_start;
+
+  // Per block, the references to it beyond the first: a block a
+  // snapshot shares with the live filesystem or another snapshot, or
+  // one dedup found the same data written to again. Kept in the CBLOCK
+  // region; sdirty holds the region blocks to log.
+  std::vector<uint16_t> shares;
+  std::set<uint32_t> sdirty;
+  uint32_t table_start;   // first block the inode table began with
+
+  // CRC32C of every block but the superblock, the journal and the
+  // KBLOCK region holding these, computed as the block is written and
+  // checked as it is read; 0 for one never written, which is not
+  // checked. ksum_start and ksum_end bound the region, and kdirty holds
+  // its blocks to log. Data blocks are not journaled: those in ddirty,
+  // written since the last commit, go to the disk before its record,
+  // so a new block is on disk before the checksum naming it. A block
+  // in rewritten, written over in place, is held in the cache instead
+  // and commits unchecked, its checksum following in the next
+  // transaction, since until it is home the disk may hold either copy.
+  std::vector<uint32_t> sums;
+  std::set<uint32_t> kdirty;
+  std::set<blockid_t> ddirty, rewritten;
+  uint32_t ksum_start, ksum_end;
+  csum_stats kst;
+
+  // Content-addressed dedup, on with YFS_DEDUP: the data blocks of
+  // live files by fingerprint, and the other way round.
+  // Shared blocks count their references in shares like snapshots do.
+  bool dedup;
+  std::unordered_map<uint64_t, blockid_t> fingerprints;
+  std::unordered_map<blockid_t, uint64_t> fingerprint_of;
+  dedup_stats dst;
+
+  // Blocks freed by the running transaction. Until it commits they
+  // stay set in bitmap, so they are not reused, but are logged clear.
+  std::vector<uint32_t> held;
+  std::vector<uint64_t> heldmap;
+
+  // Free-extent index over the same bitmap: every maximal run of free
+  // blocks, by start and by length, for allocating contiguous runs.
+  std::map<uint32_t, uint32_t> free_runs;          // start -> length
+  std::multimap<uint32_t, uint32_t> runs_by_size;  // length -> start
+
+  void load_bitmap();
+  void load_shares();
+  void write_shares();
+  void load_sums();
+  void write_sums();
+  bool summed(uint32_t id);
+  void set_sum(uint32_t id, const char *buf, uint32_t len);
+  bool check_sum(uint32_t id, char *buf);
+  void mark_block(uint32_t id, bool used);
+  void write_bitmap(uint32_t id);
+  void log_meta(uint32_t id, const char *buf);
+  void add_run(uint32_t start, uint32_t len);
+  void del_run(std::map<uint32_t, uint32_t>::iterator it);
+  void take_run(uint32_t start, uint32_t len);
+  void index_runs();
+  void write_super();
+  void commit();
+  void checkpoint();
+  void release_held();
+  void note_data(blockid_t id, const char *buf, uint32_t len);
+  void forget_data(blockid_t id);
+
  public:
   block_manager();
   struct superblock sb;
 
+  bool remounted() { return mounted; }
+  uint32_t free_blocks();
   uint32_t alloc_block();
+  uint32_t alloc_blocks(uint32_t n, std::vector<blockid_t> &ids);
   void free_block(uint32_t id);
-  void read_block(uint32_t id, char *buf);
+  bool share_block(uint32_t id);
+  bool shared(uint32_t id) {
+    return __atomic_load_n(&shares[id], __ATOMIC_RELAXED) > 0;
+  }
+  bool own_block(uint32_t id);
+  bool deduping() { return dedup; }
+  blockid_t find_dup(const char *buf);
+  void index_data(std::vector<blockid_t> &ids);
+  bool read_block(uint32_t id, char *buf);
   void write_block(uint32_t id, const char *buf);
+  bool read_blocks(std::vector<block_io> &ios);
+  void write_blocks(std::vector<block_io> &ios);
+  void write_meta(uint32_t id, const char *buf);
+  void begin_op();
+  void end_op();
+  void sync();
+  const bcache_stats &cache_stats() { return bc->stats(); }
+  bool cached(blockid_t id) { return bc->cached(id); }
+  void prefetch(const std::vector<blockid_t> &ids) { bc->prefetch(ids); }
+  const journal_stats &log_stats() { return j->stats(); }
+  const dedup_stats &dup_stats() { return dst; }
+  const csum_stats &sum_stats() { return kst; }
 };
 
 // inode layer -----------------------------------------
 
-#define INODE_NUM  1024
+#define INODE_NUM  4096
+
+// read_file() and read_range() return this for a block that fails
+// its checksum.
+#define IM_EIO     (-2)
 
 // Inodes per block.
-#define IPB           1
-//(BLOCK_SIZE / sizeof(struct inode))
+#define IPB           (BLOCK_SIZE / sizeof(struct inode))
+
+// The inode bitmap follows the block bitmap, then come the snapshot
+// table, the share counts, the block checksums, the inode table and
+// the journal.
+// |<-sb->|<-block bitmap->|<-inode bitmap->|<-snap->|<-shares->|<-sums->|<-itable->|<-inode table->|<-journal->|<-data->|
+//
+// The inode table is found through itable blocks, each holding the
+// addresses of NINDIRECT inode blocks, whose addresses are in the
+// snapshot table. Both start out at the fixed places below but move
+// when copied on write, so a snapshot is just another set of itable
+// addresses sharing blocks with the live filesystem.
+
+// Block containing bit for inode i
+#define IMBLOCK(i, nblocks)    (((nblocks)+BPB-1)/BPB + (i)/BPB + 2)
+
+// Snapshot table block
+#define SNAPBLOCK(nblocks)     IMBLOCK(INODE_NUM+BPB-1, nblocks)
+
+// Share counts per block, and the block containing that of block b
+#define SPB                    (BLOCK_SIZE/sizeof(uint16_t))
+#define CBLOCK(b, nblocks)     (SNAPBLOCK(nblocks) + 1 + (b)/SPB)
+
+// Checksums per block, and the block containing that of block b
+#define KPB                    (BLOCK_SIZE/sizeof(uint32_t))
+#define KBLOCK(b, nblocks)     (CBLOCK((nblocks)+SPB-1, nblocks) + (b)/KPB)
+
+// itable blocks, enough for INODE_NUM inodes
+#define NITABLE ((INODE_NUM/IPB + NINDIRECT - 1) / NINDIRECT)
 
-// Block containing inode i(inode number -> blocknumber)
-#define IBLOCK(i, nblocks)     ((nblocks)/BPB + (i)/IPB + 3)
+// Where itable block k and inode i are when the disk is formatted
+#define TBLOCK(k, nblocks)     (KBLOCK((nblocks)+KPB-1, nblocks) + (k))
+#define IBLOCK(i, nblocks)     (TBLOCK(NITABLE, nblocks) + (i)/IPB)
 // nblocks决定block bitmap的block数
 
+// Snapshots kept at once. The inode numbers of snapshot s, 1 to
+// MAXSNAP, are those of the live filesystem with s from bit SNAP_SHIFT
+// on; its files are read-only.
+#define MAXSNAP    8
+#define SNAP_NAME  24
+#define SNAP_SHIFT 16
+#define SNAP_OF(inum)      ((inum) >> SNAP_SHIFT)
+#define LIVE_INUM(inum)    ((inum) & ((1 << SNAP_SHIFT) - 1))
+#define SNAP_INUM(s, inum) (((s) << SNAP_SHIFT) | (inum))
+
 // Bitmap bits per block
 #define BPB           (BLOCK_SIZE*8)
 
 // Block containing bit for block b
 #define BBLOCK(b) ((b)/BPB + 2)
 
-#define NDIRECT 100
-#define NINDIRECT (BLOCK_SIZE / sizeof(uint))
-#define MAXFILE (NDIRECT + NINDIRECT)
+// blocks[NDIRECT+l-1] is the root of a tree of indirect blocks l
+// levels deep, for l = 1..NLEVELS. A block address of 0, at any
+// level, is a hole: the blocks it would map read as zeros.
+#define NDIRECT 22
+#define NLEVELS 3
+#define NINDIRECT (BLOCK_SIZE / sizeof(blockid_t))
+#define MAXFILE (NDIRECT + NINDIRECT + NINDIRECT*NINDIRECT + \
+                 NINDIRECT*NINDIRECT*NINDIRECT)
+
+// Inodes kept in inode_manager's inode cache, split evenly across
+// NICACHE shards by inode block
+#define INODE_CACHE 256
+#define NICACHE 16
+
+// Bounds, in blocks, of the sequential readahead window
+#define RA_MIN 8
+#define RA_MAX 512
+
+// On an FS_EXTENTS filesystem the pointer area of an inode instead
+// holds the root of a B+tree of extents: an extent_hdr followed by up
+// to EXT_ROOT records. In a leaf (depth 0) each record maps len
+// blocks from lblock on to the run starting at pblock; in an index
+// node pblock is the child node whose first record maps lblock.
+// Nodes below the root fill a block each, EXT_NODE records. Blocks
+// no extent maps are holes.
+struct extent_hdr {
+  uint16_t depth;
+  uint16_t count;
+};
+
+struct extent_rec {
+  uint32_t lblock;
+  uint32_t pblock;
+  uint32_t len;
+};
+
+#define EXT_ROOT ((sizeof(blockid_t)*(NDIRECT+NLEVELS) - sizeof(extent_hdr)) \
+                  / sizeof(extent_rec))
+#define EXT_NODE ((BLOCK_SIZE - sizeof(extent_hdr)) / sizeof(extent_rec))
+
+// Inode flags
+#define I_INLINE   0x1   // the data is kept in blocks[] itself
+#define I_COMPRESS 0x2   // the data is kept in compressed clusters
+
+// The data of an I_COMPRESS file is compressed CLUSTER blocks at a
+// time. A cluster holding n blocks of the file, CLUSTER but for the
+// last, is a hole, none of its n blocks mapped; stored raw, all n
+// mapped as in any other file; or compressed into its first k < n
+// blocks, starting with a cluster_hdr, the rest left holes. Whether
+// block n - 1 is mapped tells the last two apart, so a cluster needs
+// no flag of its own, but a partial last cluster is stored again when
+// the file grows past it.
+#define CLUSTER 16
+#define CLUSTER_MAGIC 0x7a636c73   // "zcls"
+
+struct cluster_hdr {
+  uint32_t magic;
+  uint32_t len;       // bytes of compressed data following
+};
+
+// Compression counts
+struct compress_stats {
+  uint64_t clusters;     // clusters stored, holes excepted
+  uint64_t compressed;   // of those, stored compressed
+  uint64_t saved;        // blocks compressing them saved
+};
+
+// Largest file whose data is kept inline in its inode
+#define INLINE_MAX (sizeof(blockid_t)*(NDIRECT+NLEVELS))
 
+// On-disk inode, packed IPB to an inode block.
 typedef struct inode {
   short type;
+  unsigned short flags;
   unsigned int size;
   unsigned int atime;
   unsigned int mtime;
   unsigned int ctime;
-  blockid_t blocks[NDIRECT+1];   // Data block addresses
+  unsigned int nblocks;                // Blocks allocated, holes excluded
+  unsigned int gen;                    // Times the inum was allocated
+  blockid_t blocks[NDIRECT+NLEVELS];   // Data block addresses
 } inode_t;
 
+static_assert(sizeof(struct inode) == 128, "on-disk inode must be 128 bytes");
+
+// The snapshot table: the live filesystem's itable blocks, then those
+// of each snapshot, whose slot is free while its name is empty. gen
+// counts the times the slot was taken or given up, so that an inode
+// of one snapshot is not taken for the same inode of another.
+struct snap_entry {
+  char name[SNAP_NAME];
+  uint32_t gen;
+  blockid_t itable[NITABLE];
+};
+
+struct snap_table {
+  blockid_t itable[NITABLE];
+  struct snap_entry snap[MAXSNAP];
+};
+
+static_assert(sizeof(struct snap_table) <= BLOCK_SIZE,
+              "snapshot table must fit a block");
+
+// Inode blocks hash to this many mutexes, which keep the copies of an
+// inode block logged in the order they are made
+#define NISTRIPE 64
+
 class inode_manager {
  private:
   block_manager *bm;
-  struct inode* get_inode(uint32_t inum);
+
+  // In-memory copy of the inode bitmap kept in the IMBLOCK region.
+  // It, the live itable blocks and the snapshot table's copy of their
+  // addresses are guarded by tm.
+  std::vector<uint64_t> imap;
+  uint32_t ifree;
+  uint32_t icursor;          // imap word the next search starts at
+  uint64_t iwords_scanned;   // imap words examined by alloc_inode
+
+  // In-memory copies of the snapshot table and of the live itable
+  // blocks, indexed by inode block.
+  struct snap_table snaps;
+  std::vector<blockid_t> itab;
+
+  // What a block copied on write holds, to know which children its
+  // copy takes a share in.
+  enum { C_IDS, C_INODES, C_EXTENTS };
+
+  // Write-back cache of inodes by inum. get_inode pins an entry and
+  // holds its lock shared until release_inode, modify_inode holds it
+  // alone; put_inode only marks it dirty, and dirty inodes are logged
+  // to their inode blocks when an operation ends. disk is the inode as
+  // last put, which is what gets logged, and gen counts the puts, so a
+  // put while it is being logged leaves it dirty. The ra_ fields track
+  // sequential reads of the file for readahead. The cache is split
+  // into shards by inode block, so the inodes of a block share one;
+  // a shard's m guards its entries, and their fields but ino and lock.
+  struct cached_inode {
+    struct inode ino;
+    struct inode disk;
+    pthread_rwlock_t lock;
+    int pins;
+    bool dirty;
+    uint64_t gen;
+    std::list<uint32_t>::iterator lru;
+    uint32_t ra_next;     // block a sequential read would start at
+    uint32_t ra_window;   // blocks to read ahead; 0 when not sequential
+    uint32_t ra_end;      // blocks before this have been read ahead
+  };
+  struct icache {
+    pthread_mutex_t m;
+    std::unordered_map<uint32_t, cached_inode> inodes;
+    std::list<uint32_t> lru;         // most recently used first
+    std::set<uint32_t> dirty;        // put since an operation last ended
+    uint64_t hits, misses;
+  };
+  icache icaches[NICACHE];
+  icache &icache_of(uint32_t inum) {
+    return icaches[inum / IPB % NICACHE];
+  }
+  pthread_mutex_t istripes[NISTRIPE];
+
+  // New files are compressed with YFS_COMPRESS
+  bool compress;
+  compress_stats zst;
+
+  // Operations run at once, each holding sm shared, and lock the
+  // inodes they touch one at a time; tm guards the inode allocator and
+  // the block layer guards its own. Taking or dropping a snapshot, and
+  // sync, hold sm alone. The order is sm, the journal's admission of
+  // the operation, an inode, an inode block's stripe, tm, then the
+  // block layer.
+  pthread_rwlock_t sm;
+  pthread_mutex_t tm;
+
+  // Holds sm for the life of the object, like ScopedLock, and for an
+  // operation that writes makes the metadata it writes, dirty inodes
+  // included, one journal transaction. Operations nest; only the
+  // outermost one on a thread locks and begins anything.
+  enum { OP_READ, OP_WRITE, OP_ALL };
+  static thread_local int op_depth;
+  struct scoped_op {
+    inode_manager *im;
+    int kind;
+    scoped_op(inode_manager *im, int kind = OP_WRITE) : im(im), kind(kind) {
+      if (op_depth++ > 0)
+        return;
+      VERIFY((kind == OP_ALL ? pthread_rwlock_wrlock(&im->sm)
+                             : pthread_rwlock_rdlock(&im->sm)) == 0);
+      if (kind != OP_READ)
+        im->bm->begin_op();
+    }
+    ~scoped_op() {
+      if (--op_depth > 0)
+        return;
+      if (kind != OP_READ)
+        im->end_op();
+      VERIFY(pthread_rwlock_unlock(&im->sm) == 0);
+    }
+  };
+
+  void load_imap();
+  void mark_inode(uint32_t inum, bool used);
+  void load_snaps();
+  void index_files();
+  void write_snaps();
+  bool sharing();
+  blockid_t iblock(uint32_t inum);
+  bool own_iblock(uint32_t inum);
+  blockid_t copy_shared(blockid_t id, int kind, char *buf);
+  void share_inode(const struct inode *ino);
+  void share_extents(const extent_hdr *h);
+  void drop_itable(blockid_t id);
+  void forget_snapshot(uint32_t s);
+  bool read_indirect(blockid_t id, blockid_t *ids);
+  void write_indirect(blockid_t id, const blockid_t *ids);
+  void free_indirect(blockid_t id);
+  cached_inode *cache_inode(icache &ic, uint32_t inum, bool load);
+  struct inode *lock_inode(uint32_t inum, bool alone, bool load);
+  void evict_inode(icache &ic);
+  void write_back(uint32_t inum);
+  struct inode* get_inode(uint32_t inum, bool alone = false);
+  struct inode* modify_inode(uint32_t inum);
   void put_inode(uint32_t inum, struct inode *ino);
+  void release_inode(uint32_t inum);
+  void end_op();
+  uint32_t get_blocks(struct inode *ino, uint32_t first, uint32_t nb,
+                      std::vector<blockid_t> &ids, bool nowait = false,
+                      bool *ok = NULL);
+  bool must_wait(blockid_t id, bool nowait);
+  bool walk_blocks(blockid_t id, int level, uint32_t &skip, uint32_t &left,
+                   std::vector<blockid_t> &ids, bool nowait);
+  void fill_blocks(struct inode *ino, uint32_t first,
+                   std::vector<blockid_t> &ids,
+                   const std::vector<blockid_t> *dup = NULL);
+  void find_dups(const std::vector<blockid_t> &ids,
+                 const std::vector<const char *> &data,
+                 std::vector<blockid_t> &dup);
+  void fill_tree(struct inode *ino, blockid_t *id, int level, uint32_t base,
+                 uint32_t first, std::vector<blockid_t> &want);
+  bool own_path(struct inode *ino, uint32_t first, uint32_t nb);
+  bool own_tree(blockid_t *id, int level, uint32_t base, uint32_t first,
+                uint32_t end);
+  void trim_blocks(struct inode *ino, uint32_t nb);
+  bool punch_blocks(struct inode *ino, uint32_t first, uint32_t nb);
+  void trim_tree(struct inode *ino, blockid_t *id, int level, uint32_t base,
+                 uint32_t first, uint32_t end);
+  void drop_tree(blockid_t id, int level, uint32_t *n, bool drop);
+  void drop_extents(const extent_hdr *h);
+  int own_extents(extent_hdr *h);
+  bool extent_mapped() { return bm->sb.flags & FS_EXTENTS; }
+  void load_extents(struct inode *ino, std::vector<extent_rec> &ext,
+                    std::vector<blockid_t> &nodes);
+  void walk_extents(blockid_t id, std::vector<extent_rec> &ext,
+                    std::vector<blockid_t> &nodes);
+  bool store_extents(struct inode *ino, std::vector<extent_rec> &ext,
+                     std::vector<blockid_t> &nodes);
+  void fill_extents(struct inode *ino, uint32_t first,
+                    std::vector<blockid_t> &want);
+  bool trim_extents(struct inode *ino, uint32_t first, uint32_t end);
+  bool map_extents(extent_hdr *h, uint32_t first, uint32_t nb,
+                   std::vector<blockid_t> &ids, bool nowait, uint32_t &limit);
+  void spill_inline(struct inode *ino);
+  bool load_cluster(struct inode *ino, uint32_t c, uint32_t n, char *buf,
+                    uint32_t from = 0, uint32_t to = CLUSTER);
+  bool store_cluster(struct inode *ino, uint32_t c, uint32_t n,
+                     const char *buf);
+  bool read_clusters(struct inode *ino, uint32_t off, uint32_t len,
+                     char *buf);
+  uint32_t write_clusters(struct inode *ino, uint32_t off, uint32_t len,
+                          const char *buf);
+  void resize_clusters(struct inode *ino, uint32_t size);
+  void readahead(uint32_t inum, struct inode *ino, uint32_t first,
+                 uint32_t last);
 
  public:
   inode_manager();
   uint32_t alloc_inode(uint32_t type);
   void free_inode(uint32_t inum);
-  void read_file(uint32_t inum, char **buf, int *size);
+  int read_file(uint32_t inum, char **buf, int *size);
   void write_file(uint32_t inum, const char *buf, int size);
+  int read_range(uint32_t inum, uint32_t off, uint32_t len, char *buf);
+  int write_range(uint32_t inum, uint32_t off, uint32_t len, const char *buf);
+  int truncate_file(uint32_t inum, uint32_t size);
   void remove_file(uint32_t inum);
   void getattr(uint32_t inum, extent_protocol::attr &a);
+  void sync();
+  uint32_t snapshot(const char *name);
+  bool drop_snapshot(const char *name);
+  bool snapshot_name(uint32_t s, char *name);
+  uint32_t free_inodes() { return ifree; }
+  uint64_t imap_words_scanned() { return iwords_scanned; }
+  uint64_t inode_cache_hits();
+  uint64_t inode_cache_misses();
+  const compress_stats &zip_stats() { return zst; }
 };
 
 #endif
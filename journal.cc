@@ -0,0 +1,340 @@
+#include "journal.h"
+#include "lang/crc32c.h"
+#include "slock.h"
+#include <stdio.h>
+#include <string.h>
+#include <algorithm>
+
+journal::journal(buffer_cache *bc, journal_sb *jsb)
+  : bc(bc), jsb(jsb), head(jsb->tail), used(0), seq(jsb->seq), outstanding(0),
+    committing(false), nheld(0)
+{
+  memset(&st, 0, sizeof(st));
+  memset(filter, 0, sizeof(filter));
+  VERIFY(pthread_mutex_init(&m, 0) == 0);
+  VERIFY(pthread_cond_init(&admit, 0) == 0);
+}
+
+static uint32_t
+desc_blocks(uint32_t nlog, uint32_t nrevoke)
+{
+  size_t bytes = sizeof(journal_hdr) + (nlog + nrevoke) * sizeof(blockid_t);
+
+  return (bytes + BLOCK_SIZE - 1) / BLOCK_SIZE;
+}
+
+// Publish the size of the running transaction for empty(). Called with
+// m held.
+void
+journal::count_held()
+{
+  __atomic_store_n(&nheld, running.size() + revoked.size(), __ATOMIC_RELEASE);
+}
+
+// Blocks the running transaction's record takes.
+uint32_t
+journal::record_len()
+{
+  return desc_blocks(running.size(), revoked.size()) + running.size();
+}
+
+// Whether the running transaction has grown big enough to commit.
+// Called with m held.
+bool
+journal::full()
+{
+  return running.size() + revoked.size() >=
+         std::min(JOURNAL_BATCH, jsb->len / 4);
+}
+
+// Begin a transaction. With drain, wait too for those under way to
+// end, so that the running one commits without more joining it.
+void
+journal::begin(bool drain)
+{
+  ScopedLock l(&m);
+
+  while (committing || (outstanding > 0 && (drain || full())))
+    VERIFY(pthread_cond_wait(&admit, &m) == 0);
+  ++outstanding;
+}
+
+// End a transaction. Returns whether the caller should commit: no
+// transaction is under way and the running one has grown big enough,
+// or urgent says it cannot wait. Until the caller says it has
+// committed(), no transaction begins.
+bool
+journal::end(bool urgent)
+{
+  ScopedLock l(&m);
+
+  if (outstanding > 0)
+    --outstanding;
+  ++st.ops;
+  if (outstanding == 0 && (urgent || full())) {
+    committing = true;
+    return true;
+  }
+  // a begin() draining waits for no transaction to be under way
+  if (outstanding == 0)
+    VERIFY(pthread_cond_broadcast(&admit) == 0);
+  return false;
+}
+
+void
+journal::committed()
+{
+  ScopedLock l(&m);
+
+  committing = false;
+  VERIFY(pthread_cond_broadcast(&admit) == 0);
+}
+
+// Make block id's contents buf part of the running transaction; a
+// later write of the same block just replaces it.
+void
+journal::log(blockid_t id, const char *buf)
+{
+  ScopedLock l(&m);
+  std::vector<char> &b = running[id];
+
+  if (b.empty()) {
+    b.resize(BLOCK_SIZE);
+    __atomic_add_fetch(&filter[id % JOURNAL_FILTER], 1, __ATOMIC_RELEASE);
+  } else {
+    ++st.absorbed;
+  }
+  memcpy(&b[0], buf, BLOCK_SIZE);
+  revoked.erase(id);
+  count_held();
+}
+
+// Copy out block id if the running transaction has logged it; the
+// buffer cache only sees it once it is committed. Most blocks are not,
+// which the filter tells without m.
+bool
+journal::read(blockid_t id, char *buf)
+{
+  if (__atomic_load_n(&filter[id % JOURNAL_FILTER], __ATOMIC_ACQUIRE) == 0)
+    return false;
+
+  ScopedLock l(&m);
+  std::map<blockid_t, std::vector<char> >::iterator it = running.find(id);
+
+  if (it == running.end())
+    return false;
+  memcpy(buf, &it->second[0], BLOCK_SIZE);
+  return true;
+}
+
+// Block id has been freed: drop it from the running transaction, and
+// if a record still in the journal logged it, revoke that copy so
+// replay does not write it over whatever the block holds next.
+void
+journal::revoke(blockid_t id)
+{
+  ScopedLock l(&m);
+
+  if (running.erase(id))
+    __atomic_sub_fetch(&filter[id % JOURNAL_FILTER], 1, __ATOMIC_RELEASE);
+  if (live.count(id))
+    revoked.insert(id);
+  count_held();
+}
+
+bool
+journal::empty()
+{
+  return __atomic_load_n(&nheld, __ATOMIC_ACQUIRE) == 0;
+}
+
+// Whether the running transaction's record fits in the free part of
+// the journal, keeping to one contiguous stretch.
+bool
+journal::fits()
+{
+  uint32_t n = record_len();
+  uint32_t skip = head + n > jsb->len ? jsb->len - head : 0;
+
+  return used + skip + n <= jsb->len;
+}
+
+// Write the running transaction as one record and flush it, then let
+// its blocks go home through the buffer cache. The caller checkpoints
+// first if the record does not fit. A record bigger than the whole
+// journal cannot be logged and is written in place, unprotected.
+void
+journal::commit()
+{
+  std::vector<disk_io> ios;
+  std::vector<char> rec;
+  std::map<blockid_t, std::vector<char> >::iterator it;
+  uint32_t n = record_len(), nd, *w;
+
+  if (empty())
+    return;
+  if (n > jsb->len) {
+    printf("\tjournal: error! transaction of %u blocks too big, "
+           "writing it in place\n", n);
+    install();
+    return;
+  }
+  if (head + n > jsb->len) {
+    used += jsb->len - head;
+    head = 0;
+  }
+
+  nd = desc_blocks(running.size(), revoked.size());
+  rec.assign((size_t)n * BLOCK_SIZE, 0);
+  journal_hdr *h = (journal_hdr *)&rec[0];
+  h->magic = JOURNAL_MAGIC;
+  h->seq = seq;
+  h->nlog = running.size();
+  h->nrevoke = revoked.size();
+  w = (uint32_t *)(h + 1);
+  for (it = running.begin(); it != running.end(); ++it)
+    *w++ = it->first;
+  std::copy(revoked.begin(), revoked.end(), w);
+  char *p = &rec[(size_t)nd * BLOCK_SIZE];
+  for (it = running.begin(); it != running.end(); ++it, p += BLOCK_SIZE)
+    memcpy(p, &it->second[0], BLOCK_SIZE);
+  h->sum = crc32c(0, &rec[0], rec.size());
+
+  disk_io io = { jsb->start + head, n, &rec[0], true };
+  ios.push_back(io);
+  bc->submit(ios);
+  bc->barrier();
+
+  head += n;
+  if (head == jsb->len)
+    head = 0;
+  used += n;
+  ++seq;
+  ++st.commits;
+  st.logged += running.size();
+  install();
+}
+
+// Hand the running transaction's blocks to the buffer cache and start
+// a new one, all at once as far as read() can tell.
+void
+journal::install()
+{
+  ScopedLock l(&m);
+  std::vector<block_io> ios;
+  std::map<blockid_t, std::vector<char> >::iterator it;
+
+  for (it = running.begin(); it != running.end(); ++it) {
+    block_io io = { it->first, &it->second[0], BLOCK_SIZE };
+    ios.push_back(io);
+    live.insert(it->first);
+  }
+  bc->write(ios);
+  // only now that the cache has them may read() stop finding them here
+  for (it = running.begin(); it != running.end(); ++it)
+    __atomic_sub_fetch(&filter[it->first % JOURNAL_FILTER], 1,
+                       __ATOMIC_RELEASE);
+  running.clear();
+  revoked.clear();
+  count_held();
+}
+
+// Every committed block has reached its home location: the whole
+// journal is free again.
+void
+journal::checkpointed()
+{
+  jsb->tail = head;
+  jsb->seq = seq;
+  used = 0;
+  live.clear();
+  ++st.checkpoints;
+}
+
+// Read the record with sequence number s at offset pos into rec, if
+// there is a whole one there.
+bool
+journal::read_record(uint32_t pos, uint32_t s, std::vector<char> &rec)
+{
+  std::vector<disk_io> ios;
+  uint32_t n, sum;
+
+  if (pos >= jsb->len)
+    return false;
+  rec.assign(BLOCK_SIZE, 0);
+  disk_io io = { jsb->start + pos, 1, &rec[0], false };
+  ios.push_back(io);
+  bc->submit(ios);
+
+  journal_hdr h = *(journal_hdr *)&rec[0];
+  if (h.magic != JOURNAL_MAGIC || h.seq != s ||
+      h.nlog > jsb->len || h.nrevoke > jsb->len * 128)
+    return false;
+  n = desc_blocks(h.nlog, h.nrevoke) + h.nlog;
+  if (pos + n > jsb->len)
+    return false;
+
+  rec.assign((size_t)n * BLOCK_SIZE, 0);
+  ios[0].n = n;
+  ios[0].buf = &rec[0];
+  bc->submit(ios);
+  sum = h.sum;
+  ((journal_hdr *)&rec[0])->sum = 0;
+  return crc32c(0, &rec[0], rec.size()) == sum;
+}
+
+// On mount, write every whole record from the tail on to its home
+// locations, except blocks a later record revoked. Stops at the first
+// record that is missing or torn. Returns the number replayed; the
+// caller flushes and checkpoints.
+uint32_t
+journal::replay()
+{
+  std::vector<std::vector<char> > recs;
+  std::map<blockid_t, uint32_t> revoked_at;
+  std::vector<block_io> ios;
+  std::vector<char> rec;
+  uint32_t pos = jsb->tail, s = jsb->seq, scanned = 0;
+
+  while (scanned < jsb->len) {
+    if (!read_record(pos, s, rec)) {
+      // a record that did not fit before the end starts over at 0
+      if (pos == 0 || !read_record(0, s, rec))
+        break;
+      scanned += jsb->len - pos;
+      pos = 0;
+    }
+    journal_hdr *h = (journal_hdr *)&rec[0];
+    uint32_t n = desc_blocks(h->nlog, h->nrevoke) + h->nlog;
+    uint32_t *r = (uint32_t *)(h + 1) + h->nlog;
+    for (uint32_t i = 0; i < h->nrevoke; ++i)
+      revoked_at[r[i]] = h->seq;
+    recs.push_back(rec);
+    pos += n;
+    scanned += n;
+    ++s;
+  }
+
+  for (size_t k = 0; k < recs.size(); ++k) {
+    journal_hdr *h = (journal_hdr *)&recs[k][0];
+    uint32_t *ids = (uint32_t *)(h + 1);
+    char *p = &recs[k][(size_t)desc_blocks(h->nlog, h->nrevoke) * BLOCK_SIZE];
+    for (uint32_t i = 0; i < h->nlog; ++i, p += BLOCK_SIZE) {
+      std::map<blockid_t, uint32_t>::iterator it = revoked_at.find(ids[i]);
+      if (it != revoked_at.end() && it->second > h->seq)
+        continue;
+      block_io io = { ids[i], p, BLOCK_SIZE };
+      ios.push_back(io);
+    }
+    // later records overwrite earlier ones, so install in order
+    bc->write(ios);
+    ios.clear();
+  }
+
+  head = pos == jsb->len ? 0 : pos;
+  seq = s;
+  used = 0;
+  if (!recs.empty())
+    printf("\tjournal: replayed %u records\n", (unsigned)recs.size());
+  return recs.size();
+}
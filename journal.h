@@ -0,0 +1,120 @@
+// metadata journal interface.
+
+#ifndef journal_h
+#define journal_h
+
+#include <stdint.h>
+#include <pthread.h>
+#include <vector>
+#include <map>
+#include <set>
+#include <unordered_set>
+#include "disk.h"
+#include "bcache.h"
+
+#define JOURNAL_MAGIC 0x6a726e6c   // "jrnl"
+
+// Blocks the running transaction gathers before an end() commits it,
+// at most a quarter of the journal
+#define JOURNAL_BATCH 256u
+
+// Journal size bounds, in blocks; in between it is 1/32 of the disk
+#define JOURNAL_MIN 64
+#define JOURNAL_MAX 8192
+
+// Slots of the count of logged blocks by id that read() looks at
+// before taking the lock
+#define JOURNAL_FILTER 1024
+
+// Where the journal is, kept in the superblock. tail is the offset of
+// the oldest record that may not have been checkpointed, and seq its
+// sequence number; replay starts there.
+struct journal_sb {
+  uint32_t start;
+  uint32_t len;
+  uint32_t tail;
+  uint32_t seq;
+};
+
+// A record is a descriptor, as many blocks as it takes, followed by
+// the logged blocks in order, all contiguous in the journal. The
+// descriptor holds this header, then nlog block ids, then the nrevoke
+// ids of blocks freed since an earlier record logged them. sum covers
+// the whole record with sum itself zero, so a record torn by a crash
+// fails replay and needs no commit block or flush of its own.
+struct journal_hdr {
+  uint32_t magic;
+  uint32_t seq;
+  uint32_t nlog;
+  uint32_t nrevoke;
+  uint32_t sum;
+};
+
+struct journal_stats {
+  uint64_t ops;           // transactions ended
+  uint64_t commits;       // records written, one flush each
+  uint64_t logged;        // blocks written to the journal
+  uint64_t absorbed;      // rewrites of a block already being logged
+  uint64_t checkpoints;
+};
+
+// Write-ahead log of metadata blocks. Between begin() and end() a
+// transaction hands its metadata writes to log(), which keeps them in
+// memory; transactions that overlap or follow one another before a
+// commit share one record. commit() writes the record with a single
+// sequential write and flush, then hands the blocks to the buffer
+// cache to reach their home locations at leisure. The space they held
+// is reclaimed once the caller has flushed the cache and called
+// checkpointed().
+//
+// Transactions run at once. begin() holds a new one back while the
+// running transaction commits, or while it is full and those in it
+// have yet to end, so that it commits before it outgrows the journal;
+// commit() and the rest thus run with no transaction under way, and
+// only read() beside them. m guards the running transaction and the
+// count of those in it, and keeps the former whole for readers.
+// Beside it, nheld and filter count the blocks it holds in all and by
+// id, changed under m but read without it: empty() needs no lock, and
+// read() takes m only for a block that may have been logged.
+class journal {
+ private:
+  buffer_cache *bc;
+  journal_sb *jsb;
+  uint32_t head;      // offset the next record goes at
+  uint32_t used;      // blocks from tail to head, skipped ones included
+  uint32_t seq;       // sequence number of the next record
+  int outstanding;    // transactions begun and not ended
+  bool committing;    // an end() asked for a commit, not yet committed()
+  std::map<blockid_t, std::vector<char> > running;
+  std::set<blockid_t> revoked;
+  std::unordered_set<blockid_t> live;   // logged since the last checkpoint
+  uint32_t nheld;     // blocks logged or revoked by the running one
+  uint32_t filter[JOURNAL_FILTER];   // logged blocks by id % JOURNAL_FILTER
+  journal_stats st;
+  pthread_mutex_t m;
+  pthread_cond_t admit;
+
+  uint32_t record_len();
+  void count_held();
+  bool full();
+  bool read_record(uint32_t pos, uint32_t s, std::vector<char> &rec);
+  void install();
+
+ public:
+  journal(buffer_cache *bc, journal_sb *jsb);
+
+  void begin(bool drain = false);
+  bool end(bool urgent = false);
+  void committed();
+  void log(blockid_t id, const char *buf);
+  bool read(blockid_t id, char *buf);
+  void revoke(blockid_t id);
+  bool empty();
+  bool fits();
+  void commit();
+  void checkpointed();
+  uint32_t replay();
+  const journal_stats &stats() { return st; }
+};
+
+#endif
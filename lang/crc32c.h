@@ -0,0 +1,111 @@
+// CRC-32C (Castagnoli), for checking blocks and messages.
+
+#ifndef crc32c_h
+#define crc32c_h
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+#if defined(__x86_64__)
+#include <nmmintrin.h>
+#endif
+
+#define CRC32C_POLY 0x82f63b78   // reversed
+
+struct crc32c_table {
+    uint32_t t[256];
+
+    crc32c_table() {
+        for (uint32_t i = 0; i < 256; ++i) {
+            uint32_t c = i;
+            for (int k = 0; k < 8; ++k)
+                c = c & 1 ? (c >> 1) ^ CRC32C_POLY : c >> 1;
+            t[i] = c;
+        }
+    }
+};
+
+// A byte at a time from a table, where there is no crc32 instruction.
+static inline uint32_t
+crc32c_sw(uint32_t crc, const unsigned char *p, size_t n)
+{
+    static const crc32c_table table;
+
+    while (n-- > 0)
+        crc = table.t[(crc ^ *p++) & 0xff] ^ (crc >> 8);
+    return crc;
+}
+
+#if defined(__x86_64__)
+// Bytes each of the three streams crc32c_hw runs at once covers. The
+// crc32 instruction takes three cycles to give its result but can
+// start one a cycle, so three independent streams keep it busy.
+#define CRC32C_STRIDE 168
+
+// What running a CRC register through CRC32C_STRIDE zero bytes does to
+// it, a byte of the register at a time: the CRC is linear, so the
+// results for each byte add up.
+struct crc32c_shift {
+    uint32_t t[4][256];
+
+    crc32c_shift() {
+        unsigned char zeros[CRC32C_STRIDE] = { 0 };
+        for (int k = 0; k < 4; ++k)
+            for (uint32_t b = 0; b < 256; ++b)
+                t[k][b] = crc32c_sw(b << (8 * k), zeros, CRC32C_STRIDE);
+    }
+
+    uint32_t operator()(uint32_t c) const {
+        return t[0][c & 0xff] ^ t[1][(c >> 8) & 0xff] ^
+               t[2][(c >> 16) & 0xff] ^ t[3][c >> 24];
+    }
+};
+
+// Eight bytes at a time with SSE4.2's crc32 instruction, in three
+// interleaved streams while there is enough left for them.
+__attribute__((target("sse4.2"))) static inline uint32_t
+crc32c_hw(uint32_t crc, const unsigned char *p, size_t n)
+{
+    static const crc32c_shift shift;
+    uint64_t c0 = crc, c1, c2, w0, w1, w2;
+
+    for (; n >= 3 * CRC32C_STRIDE; n -= 3 * CRC32C_STRIDE) {
+        c1 = c2 = 0;
+        for (int i = 0; i < CRC32C_STRIDE; i += 8) {
+            memcpy(&w0, p + i, 8);
+            memcpy(&w1, p + CRC32C_STRIDE + i, 8);
+            memcpy(&w2, p + 2 * CRC32C_STRIDE + i, 8);
+            c0 = _mm_crc32_u64(c0, w0);
+            c1 = _mm_crc32_u64(c1, w1);
+            c2 = _mm_crc32_u64(c2, w2);
+        }
+        c0 = shift(shift(c0) ^ c1) ^ c2;
+        p += 3 * CRC32C_STRIDE;
+    }
+    for (; n >= 8; n -= 8, p += 8) {
+        memcpy(&w0, p, 8);
+        c0 = _mm_crc32_u64(c0, w0);
+    }
+    crc = c0;
+    while (n-- > 0)
+        crc = _mm_crc32_u8(crc, *p++);
+    return crc;
+}
+#endif
+
+// The CRC-32C of n bytes at buf, continuing from crc, which is 0 to
+// start with.
+static inline uint32_t
+crc32c(uint32_t crc, const void *buf, size_t n)
+{
+    const unsigned char *p = (const unsigned char *)buf;
+
+#if defined(__x86_64__)
+    static const bool hw = __builtin_cpu_supports("sse4.2");
+    if (hw)
+        return ~crc32c_hw(~crc, p, n);
+#endif
+    return ~crc32c_sw(~crc, p, n);
+}
+
+#endif
@@ -0,0 +1,141 @@
+#include "lz.h"
+#include <string.h>
+
+// Positions of recent four-byte strings, by hash
+#define LZ_HASH_BITS 12
+
+#define MIN15(n) ((n) < 15 ? (n) : 15)
+
+static inline uint32_t
+hash4(const unsigned char *p)
+{
+  uint32_t v;
+
+  memcpy(&v, p, sizeof(v));
+  return (v * 2654435761u) >> (32 - LZ_HASH_BITS);
+}
+
+/* Append a length of which the token holds up to 15 to *op: the rest
+ * as bytes of 255 and one of less. */
+static inline void
+put_len(unsigned char *&op, uint32_t n)
+{
+  for (n -= 15; n >= 255; n -= 255)
+    *op++ = 255;
+  *op++ = n;
+}
+
+/* Emit a sequence of nlit literals at lit followed, if mlen is not 0,
+ * by a match mlen long at offset back. Returns false if it would run
+ * past oend. */
+static bool
+emit(unsigned char *&op, unsigned char *oend, const unsigned char *lit,
+     uint32_t nlit, uint32_t offset, uint32_t mlen)
+{
+  uint32_t m = mlen ? mlen - LZ_MINMATCH : 0;
+
+  // token, length bytes, literals, offset
+  if (1 + (nlit + 240) / 255 + nlit + 2 + (m + 240) / 255 >
+      (uint32_t)(oend - op))
+    return false;
+  *op++ = (MIN15(nlit) << 4) | MIN15(m);
+  if (nlit >= 15)
+    put_len(op, nlit);
+  memcpy(op, lit, nlit);
+  op += nlit;
+  if (mlen == 0)
+    return true;
+  *op++ = offset & 0xff;
+  *op++ = offset >> 8;
+  if (m >= 15)
+    put_len(op, m);
+  return true;
+}
+
+int
+lz_compress(const char *src, uint32_t n, char *dst, uint32_t cap)
+{
+  const unsigned char *in = (const unsigned char *)src;
+  const unsigned char *ip = in, *anchor = in, *end = in + n;
+  unsigned char *op = (unsigned char *)dst, *oend = op + cap;
+  int32_t table[1 << LZ_HASH_BITS];
+
+  memset(table, 0xff, sizeof(table));
+  while (n >= LZ_MINMATCH && ip <= end - LZ_MINMATCH) {
+    uint32_t h = hash4(ip);
+    int32_t cand = table[h];
+    const unsigned char *m;
+    uint32_t mlen = LZ_MINMATCH;
+
+    table[h] = ip - in;
+    if (cand < 0 || (ip - in) - cand > LZ_WINDOW ||
+        memcmp((m = in + cand), ip, LZ_MINMATCH) != 0) {
+      // step further the longer nothing has matched, to pass over
+      // data that will not compress quickly
+      ip += 1 + ((ip - anchor) >> 6);
+      continue;
+    }
+    while (ip + mlen < end && m[mlen] == ip[mlen])
+      ++mlen;
+    if (!emit(op, oend, anchor, ip - anchor, ip - m, mlen))
+      return -1;
+    ip += mlen;
+    anchor = ip;
+  }
+  if (!emit(op, oend, anchor, end - anchor, 0, 0))
+    return -1;
+  return op - (unsigned char *)dst;
+}
+
+/* Read a length the token gave as 15 or more, from *ip, up to iend.
+ * Returns false if the input runs out first. */
+static inline bool
+get_len(const unsigned char *&ip, const unsigned char *iend, uint32_t &n)
+{
+  unsigned char c;
+
+  do {
+    if (ip >= iend)
+      return false;
+    c = *ip++;
+    n += c;
+  } while (c == 255);
+  return true;
+}
+
+int
+lz_decompress(const char *src, uint32_t n, char *dst, uint32_t cap)
+{
+  const unsigned char *ip = (const unsigned char *)src, *iend = ip + n;
+  unsigned char *op = (unsigned char *)dst, *oend = op + cap;
+
+  while (ip < iend) {
+    uint32_t token = *ip++;
+    uint32_t nlit = token >> 4, mlen = token & 15, offset;
+
+    if (nlit == 15 && !get_len(ip, iend, nlit))
+      return -1;
+    if (nlit > (uint32_t)(iend - ip) || nlit > (uint32_t)(oend - op))
+      return -1;
+    memcpy(op, ip, nlit);
+    ip += nlit;
+    op += nlit;
+    if (ip == iend)
+      break;
+
+    if (iend - ip < 2)
+      return -1;
+    offset = ip[0] | (ip[1] << 8);
+    ip += 2;
+    if (mlen == 15 && !get_len(ip, iend, mlen))
+      return -1;
+    mlen += LZ_MINMATCH;
+    if (offset == 0 || offset > (uint32_t)(op - (unsigned char *)dst) ||
+        mlen > (uint32_t)(oend - op))
+      return -1;
+    // byte by byte, as the match may overlap what it produces
+    for (const unsigned char *m = op - offset; mlen > 0; --mlen)
+      *op++ = *m++;
+  }
+  return op - (unsigned char *)dst;
+}
@@ -0,0 +1,27 @@
+// LZ77 compression of file data.
+
+#ifndef lz_h
+#define lz_h
+
+#include <stdint.h>
+
+// A compressed stream is a series of sequences in the manner of LZ4's
+// block format: a token byte, its high nibble the count of literals and
+// its low one the match length less LZ_MINMATCH, with 15 in either
+// meaning more length bytes follow; the literals; then a two-byte
+// little-endian offset back to the match and the length bytes of the
+// match. The last sequence has literals only and ends the input.
+#define LZ_MINMATCH 4
+#define LZ_WINDOW   65535
+
+// Compress n bytes at src into at most cap bytes at dst. Returns the
+// compressed length, or -1 as soon as it would exceed cap, so data
+// that does not compress is given up on early.
+int lz_compress(const char *src, uint32_t n, char *dst, uint32_t cap);
+
+// Decompress the n bytes at src into at most cap bytes at dst.
+// Returns the decompressed length, or -1 if src is not a valid stream
+// or does not fit.
+int lz_decompress(const char *src, uint32_t n, char *dst, uint32_t cap);
+
+#endif
@@ -28,9 +28,15 @@
 
 #include "extent_client.h"
 #include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <pthread.h>
 
 #define FILE_NUM 50
 #define LARGE_FILE_SIZE 512*64
+#define IMAGE "/tmp/part1_tester.img"
+#define NWRITER 8
 
 #define iprint(msg) \
     printf("[TEST_ERROR]: %s\n", msg);
@@ -224,6 +230,1187 @@ int test_remove()
     return 0;
 }
 
+/*
+ * The tests below are not scored. They run an extent server of their
+ * own on a disk image, which it keeps across a remount.
+ */
+
+// Start an extent server on a fresh image, or on the one there.
+extent_server *mount(bool fresh)
+{
+    extent_server *es;
+
+    if (fresh)
+        unlink(IMAGE);
+    setenv("YFS_DISK_IMAGE", IMAGE, 1);
+    es = new extent_server();
+    unsetenv("YFS_DISK_IMAGE");
+    return es;
+}
+
+// Change a byte of the block of the image holding exactly data.
+int corrupt(const std::string &data)
+{
+    char b[BLOCK_SIZE];
+    int fd = open(IMAGE, O_RDWR);
+    off_t off;
+
+    for (off = 0; pread(fd, b, BLOCK_SIZE, off) == BLOCK_SIZE; off += BLOCK_SIZE) {
+        if (data.compare(0, BLOCK_SIZE, b, BLOCK_SIZE) == 0) {
+            b[7] ^= 1;
+            pwrite(fd, b, BLOCK_SIZE, off);
+            close(fd);
+            return 0;
+        }
+    }
+    close(fd);
+    return 1;
+}
+
+int test_checksum()
+{
+    extent_server *es;
+    extent_protocol::extentid_t id;
+    std::string data, buf;
+    int r;
+
+    printf("begin test checksum\n");
+    for (int i = 0; i < 8; i++)
+        data.append(BLOCK_SIZE, 'a' + i);
+    es = mount(true);
+    es->create(extent_protocol::T_FILE, id);
+    es->put(id, data, r);
+    es->sync();
+    if (corrupt(data.substr(3 * BLOCK_SIZE, BLOCK_SIZE)) != 0) {
+        iprint("error finding the block to corrupt");
+        return 1;
+    }
+
+    es = mount(false);
+    if (es->get(id, buf) != extent_protocol::IOERR) {
+        iprint("error get of a corrupt file, return not IOERR");
+        return 2;
+    }
+    if (es->read(id, 3 * BLOCK_SIZE + 10, 10, buf) != extent_protocol::IOERR) {
+        iprint("error read of a corrupt block, return not IOERR");
+        return 3;
+    }
+    if (es->read(id, 0, 2 * BLOCK_SIZE, buf) != extent_protocol::OK ||
+        buf != data.substr(0, 2 * BLOCK_SIZE)) {
+        iprint("error read of intact blocks of a corrupt file");
+        return 4;
+    }
+    printf("end test checksum\n");
+    return 0;
+}
+
+struct writer {
+    extent_server *es;
+    extent_protocol::extentid_t id;
+    unsigned seed;
+    std::string data;
+    int err;
+};
+
+// Create a file and write, overwrite and truncate it over and over,
+// alongside the other writers, checking it each time.
+void *write_own(void *arg)
+{
+    writer *w = (writer *)arg;
+    std::string buf;
+    int r;
+
+    if (w->es->create(extent_protocol::T_FILE, w->id) != extent_protocol::OK) {
+        w->err = 1;
+        return NULL;
+    }
+    for (int k = 0; k < 60; k++) {
+        unsigned off = rand_r(&w->seed) % (w->data.size() + 4 * BLOCK_SIZE);
+        unsigned len = rand_r(&w->seed) % (16 * BLOCK_SIZE) + 1;
+        std::string d(len, 0);
+
+        for (unsigned i = 0; i < len; i++)
+            d[i] = 'a' + (i * 7 + k + w->seed) % 26;
+        if (w->es->write(w->id, off, d, r) != extent_protocol::OK ||
+            r != (int)len) {
+            w->err = 2;
+            return NULL;
+        }
+        if (w->data.size() < off + len)
+            w->data.resize(off + len, 0);
+        w->data.replace(off, len, d);
+        if (k % 10 == 9) {
+            w->data.resize(w->data.size() / 2);
+            w->es->truncate(w->id, w->data.size(), r);
+        }
+        if (w->es->get(w->id, buf) != extent_protocol::OK || buf != w->data) {
+            w->err = 3;
+            return NULL;
+        }
+    }
+    return NULL;
+}
+
+int test_concurrent()
+{
+    extent_server *es;
+    pthread_t t[NWRITER];
+    writer w[NWRITER];
+    std::string buf;
+
+    printf("begin test concurrent\n");
+    es = mount(true);
+    for (int i = 0; i < NWRITER; i++) {
+        w[i].es = es;
+        w[i].seed = i + 1;
+        w[i].err = 0;
+        pthread_create(&t[i], NULL, write_own, &w[i]);
+    }
+    for (int i = 0; i < NWRITER; i++)
+        pthread_join(t[i], NULL);
+    for (int i = 0; i < NWRITER; i++) {
+        if (w[i].err != 0) {
+            iprint("error writing files at the same time");
+            return 1;
+        }
+    }
+    es->sync();
+
+    es = mount(false);
+    for (int i = 0; i < NWRITER; i++) {
+        if (es->get(w[i].id, buf) != extent_protocol::OK || buf != w[i].data) {
+            iprint("error get after remount, not what was written");
+            return 2;
+        }
+    }
+    printf("end test concurrent\n");
+    return 0;
+}
+
+// The superblock of the image.
+superblock_t super()
+{
+    char b[BLOCK_SIZE];
+    superblock_t sb;
+    int fd = open(IMAGE, O_RDONLY);
+
+    pread(fd, b, BLOCK_SIZE, BLOCK_SIZE);
+    close(fd);
+    memcpy(&sb, b, sizeof(sb));
+    return sb;
+}
+
+// The blocks the record replay would start at takes, its offset in the
+// image in off; 0 if there is none.
+uint32_t pending(off_t &off)
+{
+    char b[BLOCK_SIZE];
+    superblock_t sb = super();
+    journal_hdr h;
+    int fd = open(IMAGE, O_RDONLY);
+
+    off = (off_t)(sb.journal.start + sb.journal.tail) * BLOCK_SIZE;
+    pread(fd, b, BLOCK_SIZE, off);
+    close(fd);
+    memcpy(&h, b, sizeof(h));
+    if (h.magic != JOURNAL_MAGIC || h.seq != sb.journal.seq)
+        return 0;
+    return (sizeof(h) + (h.nlog + h.nrevoke) * sizeof(blockid_t) +
+            BLOCK_SIZE - 1) / BLOCK_SIZE + h.nlog;
+}
+
+// The whole image, to put back with set_image().
+std::string image()
+{
+    std::string img;
+    char b[BLOCK_SIZE];
+    int fd = open(IMAGE, O_RDONLY);
+
+    while (read(fd, b, BLOCK_SIZE) == BLOCK_SIZE)
+        img.append(b, BLOCK_SIZE);
+    close(fd);
+    return img;
+}
+
+void set_image(const std::string &img)
+{
+    int fd = open(IMAGE, O_WRONLY);
+
+    pwrite(fd, img.data(), img.size(), 0);
+    close(fd);
+}
+
+// Whether the first files of ids hold what want says, the rest not
+// existing.
+bool holds(extent_server *es, std::vector<extent_protocol::extentid_t> &ids,
+           std::vector<std::string> &want)
+{
+    extent_protocol::attr a;
+    std::string buf;
+
+    for (size_t i = 0; i < ids.size(); i++) {
+        es->getattr(ids[i], a);
+        if (i >= want.size() ? a.type != 0 :
+            es->get(ids[i], buf) != extent_protocol::OK || buf != want[i])
+            return false;
+    }
+    return true;
+}
+
+// Crash after the journal committed some operations but before any of
+// them reached their home locations: a remount must replay the record,
+// and must ignore it once torn. The cache is big enough that nothing
+// goes home before a checkpoint, and the disk small enough that the
+// journal commits after a few dozen files.
+int test_replay()
+{
+    extent_server *es;
+    extent_protocol::extentid_t id;
+    std::vector<extent_protocol::extentid_t> ids;
+    std::vector<std::string> data, synced, committed;
+    std::string img;
+    char b[BLOCK_SIZE];
+    uint32_t len = 0;
+    off_t off;
+    int fd, r;
+
+    printf("begin test replay\n");
+    setenv("YFS_DISK_SIZE", "2097152", 1);
+    setenv("YFS_CACHE_SIZE", "4194304", 1);
+    es = mount(true);
+    es->create(extent_protocol::T_FILE, id);
+    ids.push_back(id);
+    data.push_back(std::string(BLOCK_SIZE, 's'));
+    es->put(id, data.back(), r);
+    es->sync();
+    synced = data;
+
+    // files until a commit, then a few the journal has yet to commit
+    for (int i = 0; committed.empty() || ids.size() < committed.size() + 3; i++) {
+        if (i == 1000) {
+            iprint("error no journal commit after 1000 files");
+            return 1;
+        }
+        es->create(extent_protocol::T_FILE, id);
+        ids.push_back(id);
+        data.push_back("");
+        if (committed.empty() && (len = pending(off)) != 0)
+            committed = data;
+        data.back() = std::string(2 * BLOCK_SIZE, 'a' + i % 26);
+        data.back()[0] = i;
+        es->put(id, data.back(), r);
+        if (committed.empty() && (len = pending(off)) != 0)
+            committed = data;
+    }
+    img = image();
+
+    fd = open(IMAGE, O_RDWR);
+    off += (off_t)(len - 1) * BLOCK_SIZE;
+    pread(fd, b, BLOCK_SIZE, off);
+    b[7] ^= 1;
+    pwrite(fd, b, BLOCK_SIZE, off);
+    close(fd);
+    es = mount(false);
+    if (!holds(es, ids, synced)) {
+        iprint("error torn journal record replayed");
+        return 2;
+    }
+
+    set_image(img);
+    es = mount(false);
+    unsetenv("YFS_DISK_SIZE");
+    unsetenv("YFS_CACHE_SIZE");
+    if (!holds(es, ids, committed)) {
+        iprint("error remount not what the journal committed");
+        return 3;
+    }
+    printf("end test replay\n");
+    return 0;
+}
+
+// A block a record logs, then frees and revokes in a later record, and
+// which then holds file data written in place, must not be replayed
+// over. Runs the journal on a disk of its own, with no filesystem.
+int test_revoke()
+{
+    journal_sb jsb = { 64, 64, 0, 1 };
+    std::vector<blockid_t> ids(1, 200);
+    std::string a(BLOCK_SIZE, 'A'), z(BLOCK_SIZE, 'Z'), d(BLOCK_SIZE, 'D');
+    std::string y(BLOCK_SIZE, 'Y');
+    char b[BLOCK_SIZE];
+    mem_disk *disk;
+    buffer_cache *bc;
+    journal *j;
+
+    printf("begin test revoke\n");
+    unlink(IMAGE);
+    disk = new mem_disk(IMAGE, 256);
+    bc = new buffer_cache(disk, 256);
+    j = new journal(bc, &jsb);
+    j->begin();
+    j->log(200, a.data());
+    j->log(201, z.data());
+    j->end(true);
+    j->commit();
+    j->committed();
+    j->begin();
+    j->revoke(200);
+    j->end(true);
+    j->commit();
+    j->committed();
+    block_io io = { 200, (char *)d.data(), BLOCK_SIZE };
+    std::vector<block_io> ios(1, io);
+    bc->write(ios, true);
+    bc->flush(ids);
+    bc->barrier();
+    // and a last record, torn
+    j->begin();
+    j->log(202, y.data());
+    j->end(true);
+    j->commit();
+    j->committed();
+    if (corrupt(y) != 0) {
+        iprint("error finding the journal record to tear");
+        return 1;
+    }
+
+    jsb.tail = 0;
+    jsb.seq = 1;
+    disk = new mem_disk(IMAGE, 256);
+    bc = new buffer_cache(disk, 256);
+    j = new journal(bc, &jsb);
+    if (j->replay() != 2) {
+        iprint("error replay, not the two whole records");
+        return 2;
+    }
+    bc->flush();
+    disk->read_block(200, b);
+    if (d.compare(0, BLOCK_SIZE, b, BLOCK_SIZE) != 0) {
+        iprint("error revoked block replayed");
+        return 3;
+    }
+    disk->read_block(201, b);
+    if (z.compare(0, BLOCK_SIZE, b, BLOCK_SIZE) != 0) {
+        iprint("error logged block not replayed");
+        return 4;
+    }
+    disk->read_block(202, b);
+    if (y.compare(0, BLOCK_SIZE, b, BLOCK_SIZE) == 0) {
+        iprint("error block of a torn record replayed");
+        return 5;
+    }
+    printf("end test revoke\n");
+    return 0;
+}
+
+// The blocks the image's bitmap has in use, and of those the ones with
+// more than one reference.
+uint32_t used_blocks(uint32_t &shared)
+{
+    superblock_t sb = super();
+    char b[BLOCK_SIZE];
+    uint16_t *c = (uint16_t *)b;
+    uint32_t used = 0;
+    int fd = open(IMAGE, O_RDONLY);
+
+    shared = 0;
+    for (uint32_t id = 0; id < sb.nblocks; id++) {
+        if (id % BPB == 0)
+            pread(fd, b, BLOCK_SIZE, (off_t)BBLOCK(id) * BLOCK_SIZE);
+        used += (b[id % BPB / 8] >> (id % 8)) & 1;
+    }
+    for (uint32_t id = 0; id < sb.nblocks; id++) {
+        if (id % SPB == 0)
+            pread(fd, b, BLOCK_SIZE, (off_t)CBLOCK(id, sb.nblocks) * BLOCK_SIZE);
+        shared += c[id % SPB] != 0;
+    }
+    close(fd);
+    return used;
+}
+
+// A snapshot keeps what its files held while the live ones change,
+// takes no writes, and leaves behind, once dropped, just the blocks
+// the same changes would have used with no snapshot taken: the first
+// pass makes them without one.
+int test_snapshot()
+{
+    extent_server *es;
+    extent_protocol::extentid_t f, g, root = 0;
+    extent_protocol::attr a;
+    std::string f0(40 * BLOCK_SIZE, 0), g0(3 * BLOCK_SIZE, 'g'), f1, buf;
+    uint32_t used[2], shared, s = 0, gen = 0;
+    int r;
+
+    printf("begin test snapshot\n");
+    for (size_t i = 0; i < f0.size(); i++)
+        f0[i] = i % BLOCK_SIZE ? 'a' + i / BLOCK_SIZE % 26 : i / BLOCK_SIZE;
+    f1 = f0;
+    f1.replace(10 * BLOCK_SIZE, 5 * BLOCK_SIZE, 5 * BLOCK_SIZE, 'x');
+    for (int snap = 0; snap < 2; snap++) {
+        es = mount(true);
+        es->create(extent_protocol::T_FILE, f);
+        es->put(f, f0, r);
+        es->create(extent_protocol::T_FILE, g);
+        es->put(g, g0, r);
+        es->sync();
+        if (snap) {
+            if (es->snapshot("s1", root) != extent_protocol::OK) {
+                iprint("error taking a snapshot");
+                return 1;
+            }
+            s = SNAP_OF(root);
+            es->getattr(SNAP_INUM(s, f), a);
+            if ((gen = a.generation) == 0) {
+                iprint("error snapshot inode has the live generation");
+                return 1;
+            }
+        }
+        es->write(f, 10 * BLOCK_SIZE, f1.substr(10 * BLOCK_SIZE, 5 * BLOCK_SIZE), r);
+        es->truncate(g, 0, r);
+        if (snap) {
+            if (es->get(SNAP_INUM(s, f), buf) != extent_protocol::OK || buf != f0 ||
+                es->get(SNAP_INUM(s, g), buf) != extent_protocol::OK || buf != g0) {
+                iprint("error snapshot changed with the live files");
+                return 2;
+            }
+            if (es->write(SNAP_INUM(s, f), 0, "y", r) != extent_protocol::IOERR ||
+                es->put(SNAP_INUM(s, f), "y", r) != extent_protocol::IOERR ||
+                es->truncate(SNAP_INUM(s, g), 0, r) != extent_protocol::IOERR ||
+                es->remove(SNAP_INUM(s, g), r) != extent_protocol::IOERR ||
+                es->get(SNAP_INUM(s, f), buf) != extent_protocol::OK || buf != f0) {
+                iprint("error snapshot file written, not read-only");
+                return 3;
+            }
+            if (es->unsnapshot("s1", r) != extent_protocol::OK) {
+                iprint("error dropping a snapshot");
+                return 4;
+            }
+        }
+        es->sync();
+        used[snap] = used_blocks(shared);
+    }
+    if (used[1] != used[0] || shared != 0) {
+        iprint("error dropped snapshot's blocks not all freed");
+        return 5;
+    }
+    if (es->get(f, buf) != extent_protocol::OK || buf != f1) {
+        iprint("error live file changed by dropping a snapshot");
+        return 6;
+    }
+
+    // the slot given up holds the new snapshot, none of the old, and
+    // its inodes have a generation of their own
+    if (es->snapshot("s2", root) != extent_protocol::OK || SNAP_OF(root) != s) {
+        iprint("error snapshot not taken in the slot given up");
+        return 7;
+    }
+    es->getattr(SNAP_INUM(s, f), a);
+    if (a.generation == gen) {
+        iprint("error snapshot in a reused slot has the old generation");
+        return 8;
+    }
+    gen = a.generation;
+    for (int remount = 0; remount < 2; remount++) {
+        if (remount) {
+            es->sync();
+            es = mount(false);
+        }
+        a.size = 1;
+        es->getattr(SNAP_INUM(s, g), a);
+        if (es->get(SNAP_INUM(s, f), buf) != extent_protocol::OK || buf != f1 ||
+            a.size != 0 || a.generation != gen ||
+            es->unsnapshot("s1", r) != extent_protocol::NOENT) {
+            iprint("error snapshot in a reused slot not what was live");
+            return 9;
+        }
+    }
+    printf("end test snapshot\n");
+    return 0;
+}
+
+// With YFS_DEDUP, a file written with what another holds shares its
+// blocks, before a remount and after; writing to one of the files
+// leaves the others as they were.
+int test_dedup()
+{
+    extent_server *es;
+    extent_protocol::extentid_t f, g, h;
+    std::string d(8 * BLOCK_SIZE, 0), e, buf;
+    uint32_t used, shared, now;
+    unsigned seed = 1;
+    bool zip;
+    int r;
+
+    printf("begin test dedup\n");
+    for (size_t i = 0; i < d.size(); i++)
+        d[i] = rand_r(&seed);
+    e = d;
+    e.replace(2 * BLOCK_SIZE, BLOCK_SIZE, BLOCK_SIZE, 'e');
+    // files kept compressed are not deduplicated
+    zip = getenv("YFS_COMPRESS") != NULL;
+    unsetenv("YFS_COMPRESS");
+    setenv("YFS_DEDUP", "1", 1);
+    es = mount(true);
+    es->create(extent_protocol::T_FILE, f);
+    es->put(f, d, r);
+    es->sync();
+    used = used_blocks(shared);
+    es->create(extent_protocol::T_FILE, g);
+    es->put(g, d, r);
+    es->sync();
+    if ((now = used_blocks(shared)) != used || shared != 8) {
+        iprint("error same data written twice, blocks not shared");
+        return 1;
+    }
+    es->write(g, 2 * BLOCK_SIZE, e.substr(2 * BLOCK_SIZE, BLOCK_SIZE), r);
+    if (es->get(f, buf) != extent_protocol::OK || buf != d ||
+        es->get(g, buf) != extent_protocol::OK || buf != e) {
+        iprint("error write to a file sharing blocks changed the other");
+        return 2;
+    }
+    es->sync();
+    used = used_blocks(shared);
+
+    // the blocks written before the mount are found again
+    es = mount(false);
+    unsetenv("YFS_DEDUP");
+    if (zip)
+        setenv("YFS_COMPRESS", "1", 1);
+    es->create(extent_protocol::T_FILE, h);
+    es->put(h, d, r);
+    es->sync();
+    if ((now = used_blocks(shared)) != used || shared != 8) {
+        iprint("error data written before a remount not shared");
+        return 3;
+    }
+    es->put(f, e, r);
+    if (es->get(f, buf) != extent_protocol::OK || buf != e ||
+        es->get(g, buf) != extent_protocol::OK || buf != e ||
+        es->get(h, buf) != extent_protocol::OK || buf != d) {
+        iprint("error put to a file sharing blocks changed the others");
+        return 4;
+    }
+    printf("end test dedup\n");
+    return 0;
+}
+
+// Write len bytes of d at off to file id and to the model m of it.
+int write_model(extent_server *es, extent_protocol::extentid_t id,
+                std::string &m, size_t off, const std::string &d)
+{
+    int r;
+
+    if (m.size() < off + d.size())
+        m.resize(off + d.size(), 0);
+    m.replace(off, d.size(), d);
+    return es->write(id, off, d, r);
+}
+
+// Whether file id holds m, read whole and a block at a time.
+bool matches(extent_server *es, extent_protocol::extentid_t id,
+             const std::string &m)
+{
+    std::string buf;
+
+    if (es->get(id, buf) != extent_protocol::OK || buf != m)
+        return false;
+    for (size_t off = 0; off < m.size(); off += BLOCK_SIZE - 100) {
+        if (es->read(id, off, BLOCK_SIZE, buf) != extent_protocol::OK ||
+            buf != m.substr(off, BLOCK_SIZE))
+            return false;
+    }
+    return true;
+}
+
+// With YFS_COMPRESS, files are kept in compressed clusters: parts of a
+// cluster written, holes in one, truncating into one and growing the
+// file again, and data that does not compress, stored raw, must all
+// read back as written.
+int test_compress()
+{
+    extent_server *es;
+    extent_protocol::extentid_t f, g, h;
+    std::string mf, mg, mh, text, noise(CLUSTER * BLOCK_SIZE, 0);
+    uint32_t used, shared, now;
+    unsigned seed = 1;
+    bool zip;
+    int r;
+
+    printf("begin test compress\n");
+    for (int i = 0; text.size() < 40 * BLOCK_SIZE; i++)
+        text += "cluster " + std::to_string(i) + " of a file kept compressed\n";
+    text.resize(40 * BLOCK_SIZE);
+    for (size_t i = 0; i < noise.size(); i++)
+        noise[i] = rand_r(&seed);
+    zip = getenv("YFS_COMPRESS") != NULL;
+    setenv("YFS_COMPRESS", "1", 1);
+    es = mount(true);
+    es->sync();
+    used = used_blocks(shared);
+    es->create(extent_protocol::T_FILE, f);
+    write_model(es, f, mf, 0, text.substr(0, CLUSTER * BLOCK_SIZE));
+    es->create(extent_protocol::T_FILE, h);
+    write_model(es, h, mh, 0, noise);
+    es->sync();
+    now = used_blocks(shared);
+    if (!matches(es, f, mf) || !matches(es, h, mh) ||
+        now - used >= 2 * CLUSTER || now - used <= CLUSTER) {
+        iprint("error a cluster that compresses not stored in fewer blocks");
+        return 1;
+    }
+
+    // a few bytes at a time, across clusters and into the last
+    write_model(es, f, mf, CLUSTER * BLOCK_SIZE, text.substr(CLUSTER * BLOCK_SIZE));
+    write_model(es, f, mf, CLUSTER * BLOCK_SIZE + 300, "partial");
+    write_model(es, f, mf, 2 * CLUSTER * BLOCK_SIZE - 10, std::string(30, 'p'));
+    write_model(es, f, mf, mf.size() - 1, "end");
+    write_model(es, h, mh, 5 * BLOCK_SIZE + 1, "raw");
+    if (!matches(es, f, mf) || !matches(es, h, mh)) {
+        iprint("error part of a cluster written");
+        return 2;
+    }
+
+    // holes: inside a cluster, past the end, and a whole cluster
+    es->create(extent_protocol::T_FILE, g);
+    write_model(es, g, mg, 3 * BLOCK_SIZE + 5, text.substr(0, BLOCK_SIZE));
+    write_model(es, g, mg, 12 * BLOCK_SIZE, text.substr(0, 10));
+    write_model(es, g, mg, 3 * CLUSTER * BLOCK_SIZE + 7, text.substr(0, 100));
+    if (!matches(es, g, mg)) {
+        iprint("error holes in a compressed file not zeros");
+        return 3;
+    }
+
+    // truncating into a cluster leaves zeros past the end when it grows
+    mf.resize(CLUSTER * BLOCK_SIZE + 777);
+    es->truncate(f, mf.size(), r);
+    if (!matches(es, f, mf)) {
+        iprint("error truncate into a cluster");
+        return 4;
+    }
+    mf.resize(3 * CLUSTER * BLOCK_SIZE);
+    es->truncate(f, mf.size(), r);
+    mh.resize(3 * BLOCK_SIZE + 1);
+    es->truncate(h, mh.size(), r);
+    mh.resize(12 * BLOCK_SIZE);
+    es->truncate(h, mh.size(), r);
+    if (!matches(es, f, mf) || !matches(es, h, mh)) {
+        iprint("error file truncated into a cluster and grown again");
+        return 5;
+    }
+    write_model(es, h, mh, 7 * BLOCK_SIZE, "x");
+    if (!matches(es, h, mh)) {
+        iprint("error write into a cluster grown by truncate");
+        return 6;
+    }
+
+    es->sync();
+    es = mount(false);
+    if (!zip)
+        unsetenv("YFS_COMPRESS");
+    if (!matches(es, f, mf) || !matches(es, g, mg) || !matches(es, h, mh)) {
+        iprint("error compressed files after remount");
+        return 7;
+    }
+    printf("end test compress\n");
+    return 0;
+}
+
+// Files written through each disk engine read back the same through
+// every engine after a remount: the engines share one image format.
+int test_engines()
+{
+    const char *engines[] = { "mmap", "direct", "uring" };
+    extent_server *es;
+    extent_protocol::extentid_t id[3];
+    std::string data[3], buf, engine;
+    bool had = getenv("YFS_DISK_ENGINE") != NULL;
+    int r;
+
+    printf("begin test engines\n");
+    if (had)
+        engine = getenv("YFS_DISK_ENGINE");
+    for (int e = 0; e < 3; e++) {
+        setenv("YFS_DISK_ENGINE", engines[e], 1);
+        es = mount(e == 0);
+        data[e].resize((40 + 30 * e) * BLOCK_SIZE + 100);
+        for (size_t i = 0; i < data[e].size(); i++)
+            data[e][i] = 'a' + (i / 7 + e) % 26;
+        es->create(extent_protocol::T_FILE, id[e]);
+        es->put(id[e], data[e], r);
+        data[e].replace(5 * BLOCK_SIZE + 3, 2 * BLOCK_SIZE,
+                        2 * BLOCK_SIZE, '0' + e);
+        es->write(id[e], 5 * BLOCK_SIZE + 3, data[e].substr(5 * BLOCK_SIZE + 3,
+                  2 * BLOCK_SIZE), r);
+        es->sync();
+    }
+
+    for (int e = 0; e < 3; e++) {
+        setenv("YFS_DISK_ENGINE", engines[e], 1);
+        es = mount(false);
+        for (int k = 0; k < 3; k++) {
+            if (es->get(id[k], buf) != extent_protocol::OK || buf != data[k]) {
+                printf("%s read back a file written through %s\n",
+                       engines[e], engines[k]);
+                iprint("error file not the same through another disk engine");
+                return 1;
+            }
+        }
+    }
+    if (had)
+        setenv("YFS_DISK_ENGINE", engine.c_str(), 1);
+    else
+        unsetenv("YFS_DISK_ENGINE");
+    printf("end test engines\n");
+    return 0;
+}
+
+// Set environment flag name for the mounts to come, or clear it, and
+// return whether it was set before, to put back with another call.
+bool set_flag(const char *name, bool on)
+{
+    bool was = getenv(name) != NULL;
+
+    if (on)
+        setenv(name, "1", 1);
+    else
+        unsetenv(name);
+    return was;
+}
+
+// What test_limits writes to block b of its file.
+std::string edge_data(uint32_t b)
+{
+    std::string d = "block " + std::to_string(b) + " ";
+
+    while (d.size() < BLOCK_SIZE)
+        d += d;
+    return d.substr(0, BLOCK_SIZE);
+}
+
+// Whether each block in edges holds edge_data, with zeros in the
+// block before it when that is a hole.
+bool edges_match(extent_server *es, extent_protocol::extentid_t id,
+                 const uint32_t *edges, int n)
+{
+    std::string buf;
+
+    for (int i = 0; i < n; i++) {
+        if (es->read(id, (size_t)edges[i] * BLOCK_SIZE, BLOCK_SIZE, buf) !=
+            extent_protocol::OK || buf != edge_data(edges[i]))
+            return false;
+        if (i == 0 || edges[i - 1] + 1 == edges[i])
+            continue;
+        if (es->read(id, (size_t)(edges[i] - 1) * BLOCK_SIZE, BLOCK_SIZE, buf) !=
+            extent_protocol::OK || buf != std::string(BLOCK_SIZE, 0))
+            return false;
+    }
+    return true;
+}
+
+// Blocks of a file either side of where its block map moves from the
+// direct blocks to each level of indirect ones, up to the last block
+// MAXFILE allows, read back as written; writes past MAXFILE write
+// nothing and one across it writes just the part before.
+int test_limits()
+{
+    const uint32_t edges[] = {
+        0, NDIRECT - 1, NDIRECT, NDIRECT + NINDIRECT - 1,
+        NDIRECT + NINDIRECT, NDIRECT + NINDIRECT + NINDIRECT * NINDIRECT - 1,
+        NDIRECT + NINDIRECT + NINDIRECT * NINDIRECT, MAXFILE - 1
+    };
+    const int n = sizeof(edges) / sizeof(edges[0]);
+    extent_server *es;
+    extent_protocol::extentid_t f;
+    extent_protocol::attr a;
+    bool ext, zip;
+    int r;
+
+    printf("begin test limits\n");
+    ext = set_flag("YFS_EXTENTS", false);
+    zip = set_flag("YFS_COMPRESS", false);
+    es = mount(true);
+    es->create(extent_protocol::T_FILE, f);
+    for (int i = 0; i < n - 1; i++)
+        es->write(f, (size_t)edges[i] * BLOCK_SIZE, edge_data(edges[i]), r);
+    es->write(f, (size_t)(MAXFILE - 1) * BLOCK_SIZE,
+              edge_data(MAXFILE - 1) + edge_data(MAXFILE), r);
+    if (r != BLOCK_SIZE) {
+        iprint("error write across MAXFILE not cut at MAXFILE");
+        return 1;
+    }
+    if (es->write(f, (size_t)MAXFILE * BLOCK_SIZE, "x", r) !=
+        extent_protocol::OK || r != 0) {
+        iprint("error write past MAXFILE wrote something");
+        return 2;
+    }
+    es->getattr(f, a);
+    if (a.size != (size_t)MAXFILE * BLOCK_SIZE || !edges_match(es, f, edges, n)) {
+        iprint("error blocks at the edges of the indirect levels");
+        return 3;
+    }
+
+    es->sync();
+    es = mount(false);
+    set_flag("YFS_EXTENTS", ext);
+    set_flag("YFS_COMPRESS", zip);
+    if (!edges_match(es, f, edges, n)) {
+        iprint("error blocks at the edges of the indirect levels after remount");
+        return 4;
+    }
+    printf("end test limits\n");
+    return 0;
+}
+
+// Inode inum as the image has it, where the disk was formatted to
+// keep it, as it is until a snapshot is taken.
+inode_t disk_inode(uint32_t inum)
+{
+    char b[BLOCK_SIZE];
+    superblock_t sb = super();
+    int fd = open(IMAGE, O_RDONLY);
+
+    pread(fd, b, BLOCK_SIZE, (off_t)IBLOCK(inum, sb.nblocks) * BLOCK_SIZE);
+    close(fd);
+    return ((inode_t *)b)[inum % IPB];
+}
+
+// With YFS_EXTENTS, two files written a block at a time in turn each
+// get an extent per block, more than fit in the inode and in a level
+// of nodes below it. Overwriting, writing past the end and truncating
+// such a file must all read back as written, also after a remount.
+int test_extents()
+{
+    extent_server *es;
+    extent_protocol::extentid_t f, g;
+    std::string mf, mg, d;
+    bool ext, zip;
+    int r;
+
+    printf("begin test extents\n");
+    ext = set_flag("YFS_EXTENTS", true);
+    zip = set_flag("YFS_COMPRESS", false);
+    es = mount(true);
+    es->create(extent_protocol::T_FILE, f);
+    es->create(extent_protocol::T_FILE, g);
+    for (uint32_t i = 0; i < 2 * EXT_ROOT * EXT_NODE; i++) {
+        d = edge_data(i);
+        d[0] = 'f';
+        write_model(es, f, mf, (size_t)i * BLOCK_SIZE, d);
+        d[0] = 'g';
+        write_model(es, g, mg, (size_t)i * BLOCK_SIZE, d);
+    }
+    es->sync();
+    if (((extent_hdr *)disk_inode(f).blocks)->depth < 2 ||
+        !matches(es, f, mf) || !matches(es, g, mg)) {
+        iprint("error files of two levels of extent nodes");
+        return 1;
+    }
+
+    // into the middle of extents, past the end, and cut back
+    write_model(es, f, mf, 100 * BLOCK_SIZE + 50, std::string(3 * BLOCK_SIZE, 'o'));
+    write_model(es, f, mf, mf.size() + 40 * BLOCK_SIZE, "tail");
+    write_model(es, g, mg, 7, "start");
+    if (!matches(es, f, mf) || !matches(es, g, mg)) {
+        iprint("error write into a file of many extents");
+        return 2;
+    }
+    mf.resize(150 * BLOCK_SIZE + 7);
+    es->truncate(f, mf.size(), r);
+    mg.resize(5 * BLOCK_SIZE);
+    es->truncate(g, mg.size(), r);
+    write_model(es, g, mg, 20 * BLOCK_SIZE, "grown");
+    if (!matches(es, f, mf) || !matches(es, g, mg)) {
+        iprint("error truncate of a file of many extents");
+        return 3;
+    }
+
+    es->sync();
+    es = mount(false);
+    set_flag("YFS_EXTENTS", ext);
+    set_flag("YFS_COMPRESS", zip);
+    if (!matches(es, f, mf) || !matches(es, g, mg)) {
+        iprint("error files of many extents after remount");
+        return 4;
+    }
+    printf("end test extents\n");
+    return 0;
+}
+
+// Files of up to INLINE_MAX bytes are kept in their inodes and take
+// no data blocks; one growing past that moves its data to a block and
+// must keep what it held, and so must a remount.
+int test_inline()
+{
+    extent_server *es;
+    extent_protocol::extentid_t f[10];
+    std::string m[10];
+    uint32_t used, shared;
+    bool zip;
+    int r;
+
+    printf("begin test inline\n");
+    zip = set_flag("YFS_COMPRESS", false);
+    es = mount(true);
+    es->sync();
+    used = used_blocks(shared);
+    for (int i = 0; i < 10; i++) {
+        es->create(extent_protocol::T_FILE, f[i]);
+        write_model(es, f[i], m[i], 0, "inline " + std::to_string(i));
+    }
+    write_model(es, f[1], m[1], 30, "after a gap");
+    write_model(es, f[2], m[2], INLINE_MAX - 3, "end");
+    m[3].resize(60);
+    es->truncate(f[3], m[3].size(), r);
+    es->sync();
+    if (used_blocks(shared) != used) {
+        iprint("error files of up to INLINE_MAX bytes took data blocks");
+        return 1;
+    }
+    for (int i = 0; i < 10; i++) {
+        if (!matches(es, f[i], m[i])) {
+            iprint("error file kept inline");
+            return 2;
+        }
+    }
+
+    // past INLINE_MAX by a byte, by a gap, by growing, and across a
+    // block: each block holding data, the old included, takes one
+    write_model(es, f[4], m[4], INLINE_MAX, "x");
+    write_model(es, f[5], m[5], 3 * BLOCK_SIZE, "far");
+    m[6].resize(2 * BLOCK_SIZE);
+    es->truncate(f[6], m[6].size(), r);
+    write_model(es, f[7], m[7], 5, std::string(BLOCK_SIZE, 'b'));
+    es->sync();
+    if (used_blocks(shared) != used + 1 + 2 + 1 + 2) {
+        iprint("error file moved out of its inode not given its blocks");
+        return 3;
+    }
+    for (int i = 0; i < 10; i++) {
+        if (!matches(es, f[i], m[i])) {
+            iprint("error file moved out of its inode");
+            return 4;
+        }
+    }
+
+    es = mount(false);
+    set_flag("YFS_COMPRESS", zip);
+    for (int i = 0; i < 10; i++) {
+        if (!matches(es, f[i], m[i])) {
+            iprint("error inline files after remount");
+            return 5;
+        }
+    }
+    printf("end test inline\n");
+    return 0;
+}
+
+// The truncate RPC: cutting a file back into the middle of a block
+// and growing it again must read zeros where the old data was,
+// cutting it to nothing must free its blocks, and a size past
+// MAXFILE must fail, leaving the file grown to MAXFILE.
+int test_truncate()
+{
+    extent_server *es;
+    extent_protocol::extentid_t f, g;
+    extent_protocol::attr a;
+    std::string mf, mg, d;
+    uint32_t used, shared;
+    int r, ret;
+
+    printf("begin test truncate\n");
+    es = mount(true);
+    es->sync();
+    used = used_blocks(shared);
+    for (uint32_t i = 0; i < 300; i++)
+        d += edge_data(i);
+    es->create(extent_protocol::T_FILE, f);
+    write_model(es, f, mf, 0, d);
+    es->create(extent_protocol::T_FILE, g);
+    write_model(es, g, mg, 0, d.substr(0, 40 * BLOCK_SIZE));
+
+    mf.resize(200 * BLOCK_SIZE + 123);
+    if (es->truncate(f, mf.size(), r) != extent_protocol::OK ||
+        !matches(es, f, mf)) {
+        iprint("error truncate into the middle of a block");
+        return 1;
+    }
+    mf.resize(260 * BLOCK_SIZE + 5, 0);
+    es->truncate(f, mf.size(), r);
+    write_model(es, f, mf, 230 * BLOCK_SIZE, "into the grown part");
+    if (!matches(es, f, mf)) {
+        iprint("error file grown by truncate not zeros past its old end");
+        return 2;
+    }
+    ret = es->truncate(f, (unsigned long long)MAXFILE * BLOCK_SIZE + 1, r);
+    es->getattr(f, a);
+    if (ret != extent_protocol::IOERR || a.size != (size_t)MAXFILE * BLOCK_SIZE) {
+        iprint("error truncate past MAXFILE");
+        return 3;
+    }
+    es->truncate(f, mf.size(), r);
+    if (!matches(es, f, mf)) {
+        iprint("error file cut back from MAXFILE");
+        return 4;
+    }
+
+    mg.clear();
+    es->truncate(g, 0, r);
+    es->truncate(f, 0, r);
+    es->sync();
+    if (used_blocks(shared) != used || !matches(es, g, mg)) {
+        iprint("error truncate to nothing did not free the blocks");
+        return 5;
+    }
+    write_model(es, g, mg, 3 * BLOCK_SIZE, d.substr(0, 2 * BLOCK_SIZE));
+    mf = d.substr(0, 10 * BLOCK_SIZE + 1);
+    es->put(f, mf, r);
+    mf.resize(9 * BLOCK_SIZE);
+    es->truncate(f, mf.size(), r);
+
+    es->sync();
+    es = mount(false);
+    if (!matches(es, f, mf) || !matches(es, g, mg)) {
+        iprint("error truncated files after remount");
+        return 6;
+    }
+    printf("end test truncate\n");
+    return 0;
+}
+
+// Holes: blocks of a file never written take no blocks and read as
+// zeros, whole or in part, until written.
+int test_holes()
+{
+    extent_server *es;
+    extent_protocol::extentid_t f;
+    std::string mf;
+    uint32_t used, shared;
+    bool zip;
+
+    printf("begin test holes\n");
+    zip = set_flag("YFS_COMPRESS", false);
+    es = mount(true);
+    es->sync();
+    used = used_blocks(shared);
+    es->create(extent_protocol::T_FILE, f);
+    write_model(es, f, mf, 2 * BLOCK_SIZE, edge_data(2));
+    write_model(es, f, mf, 9 * BLOCK_SIZE + 100, "in the middle");
+    write_model(es, f, mf, 17 * BLOCK_SIZE - 3, "across");
+    es->sync();
+    if (used_blocks(shared) != used + 4 || !matches(es, f, mf)) {
+        iprint("error holes took blocks or did not read as zeros");
+        return 1;
+    }
+
+    // far past the end, then fill holes in part and whole
+    write_model(es, f, mf, 3000 * BLOCK_SIZE + 1, "far");
+    write_model(es, f, mf, 5 * BLOCK_SIZE + 7, "part of a hole");
+    write_model(es, f, mf, 12 * BLOCK_SIZE, edge_data(12) + edge_data(13));
+    write_model(es, f, mf, 1500 * BLOCK_SIZE, edge_data(1500));
+    if (!matches(es, f, mf)) {
+        iprint("error holes filled");
+        return 2;
+    }
+
+    es->sync();
+    es = mount(false);
+    set_flag("YFS_COMPRESS", zip);
+    if (!matches(es, f, mf)) {
+        iprint("error file with holes after remount");
+        return 3;
+    }
+    printf("end test holes\n");
+    return 0;
+}
+
+// Reading files front to back from a cold cache reads ahead of the
+// reader. Blocks written just ahead of it, after they may have been
+// read ahead, and reads of two files in turn or jumping back, must
+// still see what was last written.
+int test_readahead()
+{
+    extent_server *es;
+    extent_protocol::extentid_t f[2];
+    std::string m[2], d, buf;
+    size_t off;
+    int k;
+
+    printf("begin test readahead\n");
+    es = mount(true);
+    for (uint32_t i = 0; i < 600; i++)
+        d += edge_data(i);
+    for (k = 0; k < 2; k++) {
+        es->create(extent_protocol::T_FILE, f[k]);
+        write_model(es, f[k], m[k], 0, d);
+        d[k] ^= 1;
+    }
+    es->sync();
+
+    es = mount(false);
+    for (off = 0, k = 0; off < d.size(); off += 3000, k ^= 1) {
+        if (es->read(f[k], off, 3000, buf) != extent_protocol::OK ||
+            buf != m[k].substr(off, 3000)) {
+            iprint("error file read ahead of the reader");
+            return 1;
+        }
+        write_model(es, f[k], m[k], off + 3000 + (off / 7) % (8 * BLOCK_SIZE),
+                    "ahead " + std::to_string(off));
+        if (off % (100 * BLOCK_SIZE) < 3000)
+            es->read(f[k], off / 2, 1, buf);
+    }
+    if (!matches(es, f[0], m[0]) || !matches(es, f[1], m[1])) {
+        iprint("error files written ahead of the reader");
+        return 2;
+    }
+
+    es->sync();
+    es = mount(false);
+    if (!matches(es, f[0], m[0]) || !matches(es, f[1], m[1])) {
+        iprint("error files read ahead after remount");
+        return 3;
+    }
+    printf("end test readahead\n");
+    return 0;
+}
+
+// A file that gets the inum of a removed one has a newer generation,
+// kept across a remount, so the kernel does not take it for the old.
+int test_generation()
+{
+    extent_server *es;
+    extent_protocol::extentid_t f, g;
+    extent_protocol::attr a;
+    unsigned int gen;
+    int r;
+
+    printf("begin test generation\n");
+    es = mount(true);
+    es->create(extent_protocol::T_FILE, f);
+    es->getattr(f, a);
+    if ((gen = a.generation) == 0) {
+        iprint("error new file has no generation");
+        return 1;
+    }
+    es->remove(f, r);
+    es->create(extent_protocol::T_FILE, g);
+    es->getattr(g, a);
+    if (g != f || a.generation <= gen) {
+        iprint("error file in a reused inum has the old generation");
+        return 2;
+    }
+    gen = a.generation;
+
+    es->sync();
+    es = mount(false);
+    es->getattr(g, a);
+    if (a.generation != gen) {
+        iprint("error generation after remount");
+        return 3;
+    }
+    printf("end test generation\n");
+    return 0;
+}
+
 int main(int argc, char *argv[])
 {
     if (argc != 1) {
@@ -243,5 +1430,23 @@ int main(int argc, char *argv[])
 test_finish:
     printf("---------------------------------\n");
     printf("Part1 score is : %d/100\n", total_score);
-    return 0;
+
+    int failed = 0;
+    failed += test_checksum() != 0;
+    failed += test_concurrent() != 0;
+    failed += test_replay() != 0;
+    failed += test_revoke() != 0;
+    failed += test_snapshot() != 0;
+    failed += test_dedup() != 0;
+    failed += test_compress() != 0;
+    failed += test_engines() != 0;
+    failed += test_limits() != 0;
+    failed += test_extents() != 0;
+    failed += test_inline() != 0;
+    failed += test_truncate() != 0;
+    failed += test_holes() != 0;
+    failed += test_readahead() != 0;
+    failed += test_generation() != 0;
+    unlink(IMAGE);
+    return total_score == 100 && failed == 0 ? 0 : 1;
 }
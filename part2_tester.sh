@@ -132,6 +132,29 @@ fi
 
 test_if_has_mount
 
+##################################################################################
+# not scored: creates and unlinks at once, handled on several threads
+
+./stop.sh >/dev/null 2>&1
+YFS_FUSE_THREADS=8 ./start.sh
+test_if_has_mount
+./test-lab1-part2-g.sh yfs1 | grep -q "Passed CONCURRENT"
+if [ $? -ne 0 ];
+then
+        echo "Failed test-g"
+else
+		ps -e | grep -q "yfs_client"
+		if [ $? -ne 0 ];
+		then
+				echo "FATAL: yfs_client DIED!"
+				exit
+		else
+			echo "Passed G -- Concurrency"
+		fi
+fi
+
+test_if_has_mount
+
 ##################################################################################
 robust(){
 ./test-lab1-part2-f.sh yfs1 | grep -q "Passed ROBUSTNESS test"
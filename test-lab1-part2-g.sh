@@ -0,0 +1,69 @@
+#!/bin/bash
+
+##########################################
+#  this file contains:
+#   CONCURRENT TEST: creates and unlinks from several processes at
+#   once, in one directory and in directories of their own. Run it on
+#   a yfs_client started with YFS_FUSE_THREADS > 1.
+###########################################
+
+DIR=$1
+NPROC=8
+NFILE=40
+
+echo "CONCURRENT TEST"
+rm -rf ${DIR}/conc* >/dev/null 2>&1
+mkdir ${DIR}/conc
+for p in $(seq 1 $NPROC)
+do
+    mkdir ${DIR}/conc$p
+done
+
+# each process creates files in the shared directory and in its own,
+# unlinking every other one, and all of them race to create the
+# shared names
+worker(){
+    for i in $(seq 1 $NFILE)
+    do
+        echo $1 > ${DIR}/conc/f$1_$i
+        echo $1 > ${DIR}/conc$1/f$i
+        touch ${DIR}/conc/shared$i >/dev/null 2>&1
+        if [ $((i % 2)) -eq 0 ];
+        then
+            rm ${DIR}/conc/f$1_$i ${DIR}/conc$1/f$i
+        fi
+    done
+}
+
+for p in $(seq 1 $NPROC)
+do
+    worker $p &
+done
+wait
+
+if [ `ls ${DIR}/conc | wc -l` -ne $((NPROC * NFILE / 2 + NFILE)) ] ||
+   [ `ls ${DIR}/conc | sort | uniq -d | wc -l` -ne 0 ];
+then
+    echo "failed CONCURRENT test: entries lost or doubled in one directory"
+    exit
+fi
+for p in $(seq 1 $NPROC)
+do
+    if [ `ls ${DIR}/conc$p | wc -l` -ne $((NFILE / 2)) ];
+    then
+        echo "failed CONCURRENT test: entries lost in directory conc$p"
+        exit
+    fi
+    for i in $(seq 1 2 $NFILE)
+    do
+        if [ "`cat ${DIR}/conc/f${p}_$i ${DIR}/conc$p/f$i 2>&1`" != "$p
+$p" ];
+        then
+            echo "failed CONCURRENT test: f${p}_$i not what was written"
+            exit
+        fi
+    done
+done
+
+rm -rf ${DIR}/conc*
+echo "Passed CONCURRENT TEST"
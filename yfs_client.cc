@@ -1,6 +1,7 @@
 // yfs client.  implements FS operations using extent and lock server
 #include "yfs_client.h"
 #include "extent_client.h"
+#include "slock.h"
 #include <sstream>
 #include <iostream>
 #include <stdio.h>
@@ -12,16 +13,24 @@
 yfs_client::yfs_client()
 {
     ec = new extent_client();
-
+    init_dirlocks();
 }
 
 yfs_client::yfs_client(std::string extent_dst, std::string lock_dst)
 {
     ec = new extent_client();
+    init_dirlocks();
     if (ec->put(1, "") != extent_protocol::OK)
         printf("error init root dir\n"); // XYB: init root dir
 }
 
+void
+yfs_client::init_dirlocks()
+{
+    for (int i = 0; i < NDIRLOCK; ++i)
+        VERIFY(pthread_mutex_init(&dirlocks[i], 0) == 0);
+}
+
 yfs_client::inum
 yfs_client::n2i(std::string n)
 {
@@ -70,6 +79,9 @@ yfs_client::isdir(inum inum)
     // Oops! is this still correct when you implement symlink?
     extent_protocol::attr a;
 
+    if (inum == SNAPDIR)
+        return true;
+
     if (ec->getattr(inum, a) != extent_protocol::OK) {
         printf("error getting attr\n");
         return false;
@@ -83,6 +95,14 @@ yfs_client::isdir(inum inum)
     return false;
 }
 
+// Files in a snapshot cannot be changed, nor can .snap itself except
+// by taking and deleting snapshots.
+bool
+yfs_client::isreadonly(inum inum)
+{
+    return SNAP_OF(inum) != 0;
+}
+
 int
 yfs_client::getfile(inum inum, fileinfo &fin)
 {
@@ -99,6 +119,8 @@ yfs_client::getfile(inum inum, fileinfo &fin)
     fin.mtime = a.mtime;
     fin.ctime = a.ctime;
     fin.size = a.size;
+    fin.blocks = a.blocks;
+    fin.generation = a.generation;
     printf("getfile %016llx -> sz %llu\n", inum, fin.size);
 
 release:
@@ -112,13 +134,15 @@ yfs_client::getdir(inum inum, dirinfo &din)
 
     printf("getdir %016llx\n", inum);
     extent_protocol::attr a;
-    if (ec->getattr(inum, a) != extent_protocol::OK) {
+    // .snap shows the times of the root it sits in
+    if (ec->getattr(inum == SNAPDIR ? 1 : inum, a) != extent_protocol::OK) {
         r = IOERR;
         goto release;
     }
     din.atime = a.atime;
     din.mtime = a.mtime;
     din.ctime = a.ctime;
+    din.generation = a.generation;
 
 release:
     return r;
@@ -138,8 +162,6 @@ int
 yfs_client::setattr(inum ino, size_t size)
 {
     int r = OK;
-    extent_protocol::attr attr;
-    std::string buf;
 
     /*
      * your code goes here.
@@ -147,19 +169,8 @@ yfs_client::setattr(inum ino, size_t size)
      * according to the size (<, =, or >) content length.
      */
 
-    EXT_RPC(ec->getattr(ino, attr));
-
-    if (attr.size == size) goto release;
-
-    EXT_RPC(ec->get(ino, buf));
-
-    if (attr.size < size) {
-        EXT_RPC(ec->put(ino, buf.append(size - attr.size, '\0')));
-    }
-
-    if (attr.size > size) {
-        EXT_RPC(ec->put(ino, buf.substr(0, size)));
-    }
+    // the extent server resizes the file in place, no data crosses over
+    EXT_RPC(ec->truncate(ino, size));
 
 release:
     return r;
@@ -183,6 +194,10 @@ yfs_client::create(inum parent, const char *name, mode_t mode, inum &ino_out)
     yfs_client::dirent new_dirent;
     std::string directory_content;
 
+    if (isreadonly(parent))
+        return IOERR;
+    // the lookup too, so two creates of one name cannot both succeed
+    ScopedLock dl(dirlock(parent));
     lookup(parent, name, found, _inum);
     if (found) {
         r = EXIST;
@@ -227,6 +242,9 @@ yfs_client::mkdir(inum parent, const char *name, mode_t mode, inum &ino_out)
     dirent new_dirent;
     std::string directory;
 
+    if (parent != SNAPDIR && isreadonly(parent))
+        return IOERR;
+    ScopedLock dl(dirlock(parent));
     EXT_RPC(lookup(parent, name, found, _));
 
     if (found) {
@@ -234,6 +252,12 @@ yfs_client::mkdir(inum parent, const char *name, mode_t mode, inum &ino_out)
         goto release;
     }
 
+    if (parent == SNAPDIR) {
+        // a directory made in .snap is a snapshot of the whole tree
+        EXT_RPC(ec->snapshot(name, ino_out));
+        goto release;
+    }
+
     EXT_RPC(ec->create(extent_protocol::T_DIR, ino_out));
 
     // add dirent to parent
@@ -261,6 +285,11 @@ yfs_client::lookup(inum parent, const char *name, bool &found, inum &ino_out)
      * note: lookup file from parent dir according to name;
      * you should design the format of directory content.
      */
+    if (parent == 1 && fname == ".snap") {
+        found = true;
+        ino_out = SNAPDIR;
+        goto release;
+    }
     if ((r = readdir(parent, list)) != OK) {
         goto release;
     }
@@ -292,6 +321,9 @@ yfs_client::readdir(inum dir, std::list<dirent> &list)
      * and push the dirents to the list.
      */
 
+    if (dir == SNAPDIR)
+        return readsnaps(list);
+
     unsigned int i = 0;
     std::string buf;
     EXT_RPC(ec->get(dir, buf));
@@ -320,6 +352,9 @@ yfs_client::readdir(inum dir, std::list<dirent> &list)
         i += name_size;
         dirent.inum = n2i(buf.substr(i, dirent_size - name_size));
         i += dirent_size - name_size;
+        // a directory in a snapshot leads to files in the same one
+        if (SNAP_OF(dir) != 0)
+            dirent.inum = SNAP_INUM(SNAP_OF(dir), dirent.inum);
         list.push_back(dirent);
     }
 
@@ -328,14 +363,24 @@ release:
     return r;
 }
 
+// List .snap: a directory for each snapshot, its root.
+int
+yfs_client::readsnaps(std::list<dirent> &list)
+{
+    for (unsigned int s = 1; s <= MAXSNAP; ++s) {
+        dirent dirent;
+        if (ec->snapname(s, dirent.name) != extent_protocol::OK)
+            continue;
+        dirent.inum = SNAP_INUM((inum)s, 1);
+        list.push_back(dirent);
+    }
+    return OK;
+}
+
 int
 yfs_client::read(inum ino, size_t size, off_t off, std::string &data)
 {
     int r = OK;
-    std::string buf;
-    extent_protocol::attr attr;
-    unsigned int off_to_end;
-    unsigned int read_len;
 
     printf("> yfs_client::read: ino: %016llx, off: %ld, size: %lu\n", ino, off, size);
 
@@ -344,29 +389,16 @@ yfs_client::read(inum ino, size_t size, off_t off, std::string &data)
      * note: read using ec->get().
      */
 
+    // only the requested range comes back from the extent server
     data = "";
 
-    EXT_RPC(ec->getattr(ino, attr));
-
-    std::cout << "> read file's size: " << attr.size  << std::endl;
-
-    EXT_RPC(ec->get(ino, buf));
-
-    if (off > attr.size) {
-        data = "";
+    // a file gone is told apart from one that cannot be read
+    if ((r = ec->read(ino, off, size, data)) != extent_protocol::OK) {
+        r = r == extent_protocol::NOENT ? NOENT : IOERR;
         goto release;
     }
 
-    std::cout << "> yfs_client::read:"
-              << " origin size: " << buf.size()
-              << " file content: " << buf << std::endl;
-
-    off_to_end = buf.size() - off;
-    read_len = off_to_end < size ? off_to_end : size;
-    data = buf.substr(off, read_len);
-
-    std::cout << "> yfs_client::read finish: size: " << data.size()
-              << "read content " << data << std::endl;
+    std::cout << "> yfs_client::read finish: size: " << data.size() << std::endl;
 
 release:
     return r;
@@ -377,10 +409,7 @@ yfs_client::write(inum ino, size_t size, off_t off, const char *data,
         size_t &bytes_written)
 {
     int r = OK;
-    std::string buf;
-    std::string new_content(data);
-    extent_protocol::attr attr;
-    unsigned int enlarged_len;
+    int written = 0;
 
     printf("> yfs_client::write: ino: %016llx, off: %lu, size: %lu", ino, off, size);
     /*
@@ -390,28 +419,13 @@ yfs_client::write(inum ino, size_t size, off_t off, const char *data,
      */
     bytes_written = 0;
 
-    EXT_RPC(ec->getattr(ino, attr));
+    // the extent server zero-fills any gap between the old end and off
+    EXT_RPC(ec->write(ino, off, std::string(data, size), written));
 
-    EXT_RPC(ec->get(ino, buf));
+    bytes_written = written;
 
-    enlarged_len = off + size > attr.size ? 
-                    off + size - attr.size :
-                    0;
-    
-    std::cout << "> write: file old size: " << buf.size() << std::endl;
-    std::cout << "> write: file old content: " << buf << std::endl;
-    buf.append(enlarged_len, 0);
-    buf.replace(off, size, data, size);
-    std::cout << "> write: file new size: " << buf.size() << std::endl;
-
-    EXT_RPC(ec->put(ino, buf));
-
-    bytes_written = size;
-
-    std::cout << "> write: file new size " << buf.size() << std::endl;
     std::cout << "> yfs_client::write finish: "
-              << "file new size: " << buf.size()
-              << "new file content: " << buf << std::endl;
+              << "bytes written: " << bytes_written << std::endl;
 
 release:
     return r;
@@ -431,6 +445,11 @@ int yfs_client::unlink(inum parent,const char *name)
     std::list<dirent> dirent_list;
     std::string buf;
 
+    if (parent == SNAPDIR)
+        return ec->unsnapshot(name) == extent_protocol::OK ? OK : NOENT;
+    if (isreadonly(parent))
+        return IOERR;
+    ScopedLock dl(dirlock(parent));
     EXT_RPC(lookup(parent, name, found, inum));
 
     if (!found) {
@@ -484,10 +503,12 @@ yfs_client::readlink(inum ino, std::string &data)
 
     std::cout << "> yfs_client readlink: " << std::endl;
     int r = OK;
+    extent_protocol::attr a;
 
     // check if file is a symlink ?
 
-    if (isfile(ino) || isdir(ino)) {
+    EXT_RPC(ec->getattr(ino, a));
+    if (a.type != extent_protocol::T_LINK) {
         r = NOENT;
         goto release;
     }
@@ -5,26 +5,45 @@
 //#include "yfs_protocol.h"
 #include "extent_client.h"
 #include <vector>
+#include <pthread.h>
 
 
+// Safe to call from many threads at once, as fuse.cc does with
+// YFS_FUSE_THREADS.
 class yfs_client {
   extent_client *ec;
+
+  // Changing a directory reads its whole content, edits it and puts it
+  // back, so changes to one directory must not overlap. Directories
+  // hash to NDIRLOCK mutexes, each held for the length of a change.
+  enum { NDIRLOCK = 64 };
+  pthread_mutex_t dirlocks[NDIRLOCK];
  public:
 
   typedef unsigned long long inum;
   enum xxstatus { OK, RPCERR, NOENT, IOERR, EXIST };
   typedef int status;
 
+  // The .snap directory in the root lists the snapshots, each a
+  // read-only copy of the whole tree; mkdir in it takes one and
+  // unlink deletes one.
+  static const inum SNAPDIR = SNAP_INUM((inum)MAXSNAP + 1, 1);
+
+  // generation tells a file from the one a removed file or a dropped
+  // snapshot had under the same inum
   struct fileinfo {
     unsigned long long size;
+    unsigned long long blocks;
     unsigned long atime;
     unsigned long mtime;
     unsigned long ctime;
+    unsigned long generation;
   };
   struct dirinfo {
     unsigned long atime;
     unsigned long mtime;
     unsigned long ctime;
+    unsigned long generation;
   };
   struct dirent {
     std::string name;
@@ -48,6 +67,9 @@ class yfs_client {
  private:
   static std::string filename(inum);
   static inum n2i(std::string);
+  int readsnaps(std::list<dirent> &);
+  void init_dirlocks();
+  pthread_mutex_t *dirlock(inum dir) { return &dirlocks[dir % NDIRLOCK]; }
 
  public:
   yfs_client();
@@ -56,6 +78,7 @@ class yfs_client {
   bool isfile(inum);
   bool isdir(inum);
   bool isLink(inum);
+  bool isreadonly(inum);
 
   int getfile(inum, fileinfo &);
   int getdir(inum, dirinfo &);